@@ -0,0 +1,505 @@
+#include "minhash.h"
+#include "minimage.h"
+#include "minutil.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A distinct zone's contents and where they were first seen */
+typedef struct zoneEntry
+{
+    uint8_t digest[SHA256_DIGEST_SIZE]; /* SHA-256 of the zone contents */
+    uint32_t length;                    /* bytes of file data in the zone */
+    uint32_t refs;                      /* number of references seen */
+    uint32_t image;                     /* first image (index into argv) */
+    uint32_t inode;                     /* first inode referencing it */
+    uint32_t zone;                      /* logical zone within that file */
+    int used;                           /* slot is occupied */
+} zoneEntry;
+
+/* Content-addressed set of zones, open addressed by digest */
+typedef struct zoneIndex
+{
+    zoneEntry *entries;
+    uint64_t capacity; /* always a power of two */
+    uint64_t count;
+} zoneIndex;
+
+/* Byte counts for one image, or the whole run */
+typedef struct dedupStats
+{
+    uint64_t totalBytes;  /* file data referenced */
+    uint64_t sharedBytes; /* file data whose zone contents were already seen */
+    uint64_t files;
+    uint64_t zones;
+} dedupStats;
+
+/* State shared with the tree visitor while indexing one image */
+typedef struct indexState
+{
+    FILE *image;
+    superblock *sb;
+    uint64_t partitionStart;
+    int verbose;
+    uint32_t imageNumber;
+    char *imageName;
+    uint8_t *visited; /* bitset of inodes already indexed */
+    zoneIndex *index;
+    dedupStats *stats;
+    FILE *out;       /* optional per-reference listing */
+    minArena arena;  /* zone buffer reused for every zone of every file */
+    int failures;    /* files that could not be read */
+} indexState;
+
+/* Finds the slot for a digest, which is either a match or empty */
+zoneEntry *findSlot(zoneIndex *index, const uint8_t *digest)
+{
+    uint64_t mask = index->capacity - 1;
+    uint64_t slot;
+    memcpy(&slot, digest, sizeof(slot));
+
+    while(1)
+    {
+        zoneEntry *entry = &index->entries[slot & mask];
+        if(!entry->used ||
+           memcmp(entry->digest, digest, SHA256_DIGEST_SIZE) == 0)
+            return entry;
+        slot++;
+    }
+}
+
+/* Doubles the capacity of the index */
+void growIndex(zoneIndex *index)
+{
+    zoneIndex bigger;
+    bigger.capacity = index->capacity ? index->capacity * 2 : 1024;
+    bigger.count = index->count;
+    bigger.entries = (zoneEntry *)calloc(bigger.capacity, sizeof(zoneEntry));
+    if(bigger.entries == NULL)
+    {
+        fprintf(stderr, "ERROR: could not allocate memory for zone index!\n");
+        exit(-1);
+    }
+
+    uint64_t i;
+    for(i = 0; i < index->capacity; i++)
+    {
+        if(index->entries[i].used)
+            *findSlot(&bigger, index->entries[i].digest) = index->entries[i];
+    }
+
+    free(index->entries);
+    *index = bigger;
+}
+
+/* Records one zone of a file, returning 1 if its contents were seen before */
+int addZone(indexState *state, uint32_t number, uint32_t zone,
+            const unsigned char *data, uint32_t length)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256ctx ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, length);
+    sha256Final(&ctx, digest);
+
+    /* Keep the load factor under 3/4 */
+    if((state->index->count + 1) * 4 > state->index->capacity * 3)
+        growIndex(state->index);
+
+    zoneEntry *entry = findSlot(state->index, digest);
+    int shared = entry->used;
+
+    if(!shared)
+    {
+        memcpy(entry->digest, digest, SHA256_DIGEST_SIZE);
+        entry->length = length;
+        entry->refs = 0;
+        entry->image = state->imageNumber;
+        entry->inode = number;
+        entry->zone = zone;
+        entry->used = 1;
+        state->index->count++;
+    }
+    entry->refs++;
+
+    if(state->out != NULL)
+    {
+        int i;
+        for(i = 0; i < SHA256_DIGEST_SIZE; i++)
+            fprintf(state->out, "%02x", digest[i]);
+        fprintf(state->out, " %u %s %u %u\n", length, state->imageName, number,
+                zone);
+    }
+
+    return shared;
+}
+
+/* Hashes every data zone of each regular file in the tree */
+int indexFile(char *path, uint32_t number, inode *file, void *arg)
+{
+    indexState *state = (indexState *)arg;
+
+    if(!isRegularFile(file) || number > state->sb->ninodes)
+        return 0;
+
+    /* Hard links share their zones; only count them once */
+    if(state->visited[number / 8] & (1 << (number % 8)))
+        return 0;
+    state->visited[number / 8] |= 1 << (number % 8);
+
+    if(state->verbose == 1)
+        printf("indexing %s (inode %u)\n", path, number);
+
+    int zonesize = state->sb->blocksize << state->sb->log_zone_size;
+    int totalZones = (file->size / zonesize) + ((file->size % zonesize) != 0);
+
+    state->stats->files++;
+
+    int i;
+    for(i = 0; i < totalZones; i++)
+    {
+        arenaReset(&state->arena);
+
+        char *zoneData;
+        int status = getZoneInArena(i, file, state->image, state->sb,
+                                    state->partitionStart, state->verbose,
+                                    &state->arena, &zoneData);
+
+        /* Skip the rest of a file that cannot be read */
+        if(status != MIN_OK)
+        {
+            fprintf(stderr, "ERROR: %s: %s: %s\n", state->imageName, path,
+                    minErrorString(status));
+            state->failures++;
+            return 0;
+        }
+
+        /* Holes have no contents to share */
+        if(zoneData == NULL)
+            continue;
+
+        uint32_t length = zonesize;
+        if(i == totalZones - 1 && file->size % zonesize != 0)
+            length = file->size % zonesize;
+
+        state->stats->zones++;
+        state->stats->totalBytes += length;
+        if(addZone(state, number, i, (unsigned char *)zoneData, length))
+            state->stats->sharedBytes += length;
+    }
+
+    return 0;
+}
+
+/* Writes the line identifying an image to the index, so readers such as
+   minget -z can tell whether its zone references still hold */
+void writeImageStamp(FILE *out, char *name, int usePartition, int useSubpart)
+{
+    struct stat info;
+    if(stat(name, &info) != 0)
+        return;
+
+    fprintf(out, "# image %llu %llu %llu %lld %d %d %s\n",
+            (unsigned long long)info.st_dev, (unsigned long long)info.st_ino,
+            (unsigned long long)info.st_size, (long long)info.st_mtime,
+            usePartition, useSubpart, name);
+}
+
+/* Opens a file next to the index to build the new one in, so the old one
+   stays readable until it is replaced */
+FILE *openNewIndex(char *indexPath, char **tempPath)
+{
+    *tempPath = malloc(strlen(indexPath) + 8);
+    if(*tempPath == NULL)
+        return NULL;
+    sprintf(*tempPath, "%s.XXXXXX", indexPath);
+
+    int fd = mkstemp(*tempPath);
+    if(fd < 0)
+    {
+        free(*tempPath);
+        *tempPath = NULL;
+        return NULL;
+    }
+
+    /* Give it the permissions fopen() would have */
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    FILE *out = fdopen(fd, "w");
+    if(out == NULL)
+    {
+        close(fd);
+        unlink(*tempPath);
+        free(*tempPath);
+        *tempPath = NULL;
+    }
+
+    return out;
+}
+
+/* Copies the "# output" records minget -z appended to the old index into
+   the new one, so outputs already on disk stay reusable; records for files
+   changed or removed since are dropped */
+void carryOutputs(char *indexPath, FILE *out)
+{
+    FILE *old = fopen(indexPath, "r");
+    if(old == NULL)
+        return;
+
+    char *line = NULL;
+    size_t size = 0;
+    while(getline(&line, &size, old) != -1)
+    {
+        char digest[SHA256_HEX_SIZE];
+        unsigned length;
+        unsigned long long offset, bytes;
+        long long mtime;
+        int start = 0;
+        struct stat info;
+
+        if(sscanf(line, "# output %64s %u %llu %llu %lld %n", digest, &length,
+                  &offset, &bytes, &mtime, &start) != 5 || start == 0)
+            continue;
+
+        char *end = line + strcspn(line, "\n");
+        char saved = *end;
+        *end = '\0';
+        int current = stat(line + start, &info) == 0 &&
+                      (unsigned long long)info.st_size == bytes &&
+                      (long long)info.st_mtime == mtime;
+        *end = saved;
+
+        if(current)
+            fputs(line, out);
+    }
+
+    free(line);
+    fclose(old);
+}
+
+/* Prints one line of the byte count report */
+void printStats(char *name, dedupStats *stats)
+{
+    double percent = stats->totalBytes
+                         ? 100.0 * stats->sharedBytes / stats->totalBytes
+                         : 0.0;
+
+    printf("%-30s %8llu %8llu %12llu %12llu %12llu %6.1f%%\n", name,
+           (unsigned long long)stats->files, (unsigned long long)stats->zones,
+           (unsigned long long)stats->totalBytes,
+           (unsigned long long)stats->sharedBytes,
+           (unsigned long long)(stats->totalBytes - stats->sharedBytes),
+           percent);
+}
+
+/* Prints program usage information */
+void printUsage()
+{
+    fprintf(
+        stderr,
+        "usage: mindedup [ -v ] [ -p num [ -s num ] ] [ -o index ]"
+        " imagefile ...\n"
+        "Options:\n"
+        "-p part    --- select partition for filesystem (default: none)\n"
+        "-s sub     --- select subpartition for filesystem (default: none)\n"
+        "-o index   --- write every zone reference to a content index,\n"
+        "               which minget -z uses to reuse extracted zones;\n"
+        "               the output records minget added to an existing\n"
+        "               index are kept\n"
+        "-h help    --- print usage information and exit\n"
+        "-v verbose --- increase verbosity level\n");
+}
+
+int main(int argc, char **argv)
+{
+    /* If no arguments specified, print usage */
+    if(argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+
+    char *indexPath = NULL;
+
+    int verbose = 0;
+    int usePartition = -1;
+    int useSubpart = -1;
+
+    /* Loop through argument flags */
+    int c;
+    while((c = getopt(argc, argv, "hvp:s:o:")) != -1)
+    {
+        switch(c)
+        {
+        /* Partition is specified */
+        case 'p':
+            usePartition = atoi(optarg);
+            if(usePartition < 0 || usePartition > 3)
+            {
+                fprintf(stderr, "ERROR: partition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Subpartition is specified */
+        case 's':
+            if(usePartition == -1)
+            {
+                fprintf(stderr, "ERROR: cannot set subpartition unless main "
+                                "partition is specified.\n");
+                return -1;
+            }
+            useSubpart = atoi(optarg);
+            if(useSubpart < 0 || useSubpart > 3)
+            {
+                fprintf(stderr,
+                        "ERROR: subpartition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Index output file */
+        case 'o':
+            indexPath = optarg;
+            break;
+        /* Help flag */
+        case 'h':
+            printUsage();
+            return -1;
+        /* Verbose mode enabled */
+        case 'v':
+            verbose = 1;
+            break;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        fprintf(stderr, "ERROR: image name required.\n");
+        printUsage();
+        return -1;
+    }
+
+    FILE *out = NULL;
+    char *tempPath = NULL;
+    if(indexPath != NULL)
+    {
+        out = openNewIndex(indexPath, &tempPath);
+        if(out == NULL)
+        {
+            fprintf(stderr, "ERROR: could not create/open index file!\n");
+            return -1;
+        }
+    }
+
+    zoneIndex index = {NULL, 0, 0};
+    growIndex(&index);
+
+    dedupStats total = {0, 0, 0, 0};
+    int failures = 0;
+
+    printf("%-30s %8s %8s %12s %12s %12s %7s\n", "image", "files", "zones",
+           "bytes", "shared", "unique", "shared");
+
+    /* Only one image is open at a time; just the index carries over */
+    int i;
+    for(i = optind; i < argc; i++)
+    {
+        FILE *image = openImage(argv[i]);
+        if(image == NULL)
+        {
+            fprintf(stderr, "ERROR: %s: file not found!\n", argv[i]);
+            failures++;
+            continue;
+        }
+
+        uint64_t partitionStart;
+        superblock *sb;
+        int status = openFilesystem(image, usePartition, useSubpart,
+                                    &partitionStart, &sb);
+        if(status != MIN_OK)
+        {
+            printOpenError(status, sb);
+            fprintf(stderr, "ERROR: %s: skipping image\n", argv[i]);
+            fclose(image);
+            failures++;
+            continue;
+        }
+
+        dedupStats stats = {0, 0, 0, 0};
+
+        if(out != NULL)
+            writeImageStamp(out, argv[i], usePartition, useSubpart);
+
+        indexState state;
+        state.image = image;
+        state.sb = sb;
+        state.partitionStart = partitionStart;
+        state.verbose = verbose;
+        state.imageNumber = i - optind;
+        state.imageName = argv[i];
+        state.visited = (uint8_t *)calloc(sb->ninodes / 8 + 1, 1);
+        state.index = &index;
+        state.stats = &stats;
+        state.out = out;
+        state.failures = 0;
+        arenaInit(&state.arena, sb);
+
+        if(state.visited == NULL)
+        {
+            fprintf(stderr, "ERROR: could not allocate inode bitmap!\n");
+            if(tempPath != NULL)
+                unlink(tempPath);
+            return -1;
+        }
+
+        /* A bad directory ends this image's walk, not the whole run */
+        inode *root = NULL;
+        status = getInode(1, image, sb, partitionStart, verbose, &root);
+        if(status == MIN_OK)
+            status = walkTree("/", root, image, sb, partitionStart, verbose,
+                              indexFile, &state);
+        if(status != MIN_OK)
+        {
+            fprintf(stderr, "ERROR: %s: %s\n", argv[i], minErrorString(status));
+            state.failures++;
+        }
+        failures += state.failures;
+
+        printStats(argv[i], &stats);
+
+        total.files += stats.files;
+        total.zones += stats.zones;
+        total.totalBytes += stats.totalBytes;
+        total.sharedBytes += stats.sharedBytes;
+
+        free(root);
+        arenaFree(&state.arena);
+        free(state.visited);
+        free(sb);
+        fclose(image);
+    }
+
+    printStats("total", &total);
+    printf("distinct zones: %llu\n", (unsigned long long)index.count);
+
+    /* The new index replaces the old one only once it is complete */
+    if(out != NULL)
+    {
+        carryOutputs(indexPath, out);
+        if(fclose(out) != 0 || rename(tempPath, indexPath) != 0)
+        {
+            fprintf(stderr, "ERROR: could not write index file!\n");
+            unlink(tempPath);
+            failures++;
+        }
+        free(tempPath);
+    }
+
+    free(index.entries);
+
+    return failures ? -1 : 0;
+}
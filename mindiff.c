@@ -0,0 +1,585 @@
+#include "minimage.h"
+#include "minutil.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MODE_TYPE 0170000
+#define MODE_CHAR 0020000
+#define MODE_BLOCK 0060000
+
+/* One of the two filesystems being compared */
+typedef struct diffSide
+{
+    char *filename;
+    FILE *image;
+    superblock *sb;
+    uint64_t partitionStart;
+    uint32_t zonesize;
+    uint8_t *visited; /* directories entered, by inode number */
+} diffSide;
+
+/* A directory entry with its name terminated */
+typedef struct diffEntry
+{
+    char name[sizeof(((dirent *)0)->name) + 1];
+    uint32_t inode;
+} diffEntry;
+
+/* Options and counters for one comparison */
+typedef struct diffState
+{
+    int verbose;
+    int trustZones;   /* take zones with the same number as unchanged */
+    uint64_t changes; /* paths reported */
+    uint64_t zonesSkipped;
+    uint64_t zonesRead;
+} diffState;
+
+/* Reads one zone, or a zero filled one for a hole */
+int readZone(diffSide *side, uint32_t zone, unsigned char **data)
+{
+    if(zone != 0)
+        return getData((uint64_t)zone * side->zonesize, side->zonesize,
+                       side->image, side->partitionStart, data);
+
+    *data = calloc(1, side->zonesize);
+    return *data == NULL ? MIN_ERR_NOMEM : MIN_OK;
+}
+
+/* Compares the data of two files of the same size, zone by zone; with
+   trustZones, zones with the same number in both images are taken as
+   unchanged, so the cost follows the zones that moved */
+int compareData(diffState *state, diffSide *a, inode *fileA, diffSide *b,
+                inode *fileB, int *differs)
+{
+    *differs = 0;
+
+    /* Zone numbers are only comparable with the same geometry */
+    if(a->zonesize != b->zonesize)
+    {
+        char *contentsA;
+        char *contentsB;
+        int status = getFileContents(fileA, a->image, a->sb,
+                                     a->partitionStart, 0, &contentsA);
+        if(status != MIN_OK)
+            return status;
+        status = getFileContents(fileB, b->image, b->sb, b->partitionStart, 0,
+                                 &contentsB);
+        if(status == MIN_OK)
+        {
+            *differs = memcmp(contentsA, contentsB, fileA->size) != 0;
+            free(contentsB);
+        }
+        free(contentsA);
+        return status;
+    }
+
+    uint32_t zonesize = a->zonesize;
+    int totalZones = (fileA->size + zonesize - 1) / zonesize;
+
+    zoneCursor cursorA;
+    zoneCursor cursorB;
+    openZoneCursor(&cursorA, fileA, a->image, a->sb, a->partitionStart);
+    openZoneCursor(&cursorB, fileB, b->image, b->sb, b->partitionStart);
+
+    int status = MIN_OK;
+    int i;
+    for(i = 0; i < totalZones && !*differs && status == MIN_OK; i++)
+    {
+        uint32_t zoneA;
+        uint32_t zoneB;
+        status = getCursorZone(&cursorA, i, &zoneA);
+        if(status == MIN_OK)
+            status = getCursorZone(&cursorB, i, &zoneB);
+        if(status != MIN_OK)
+            break;
+
+        if(zoneA == zoneB && (zoneA == 0 || state->trustZones))
+        {
+            state->zonesSkipped++;
+            continue;
+        }
+
+        unsigned char *dataA;
+        unsigned char *dataB;
+        status = readZone(a, zoneA, &dataA);
+        if(status != MIN_OK)
+            break;
+        status = readZone(b, zoneB, &dataB);
+        if(status != MIN_OK)
+        {
+            free(dataA);
+            break;
+        }
+        state->zonesRead += 2;
+
+        /* The last zone only counts up to the end of the file */
+        uint32_t length = zonesize;
+        if(i == totalZones - 1 && fileA->size % zonesize != 0)
+            length = fileA->size % zonesize;
+
+        *differs = memcmp(dataA, dataB, length) != 0;
+
+        free(dataA);
+        free(dataB);
+    }
+
+    closeZoneCursor(&cursorA);
+    closeZoneCursor(&cursorB);
+
+    return status;
+}
+
+/* Orders directory entries by name */
+int compareEntries(const void *a, const void *b)
+{
+    return strcmp(((const diffEntry *)a)->name, ((const diffEntry *)b)->name);
+}
+
+/* Reads the entries of a directory (excluding . and ..), sorted by name */
+int readEntries(diffSide *side, inode *dir, diffEntry **entries, int *count)
+{
+    int direntsPerZone = side->zonesize / sizeof(dirent);
+    int containedFiles = dir->size / sizeof(dirent);
+    int totalZones = (containedFiles + direntsPerZone - 1) / direntsPerZone;
+
+    *entries = (diffEntry *)malloc((containedFiles ? containedFiles : 1) *
+                                   sizeof(diffEntry));
+    *count = 0;
+    if(*entries == NULL)
+        return MIN_ERR_NOMEM;
+
+    int z;
+    for(z = 0; z < totalZones; z++)
+    {
+        dirent *zone;
+        int status = getZoneByIndex(z, dir, side->image, side->sb,
+                                    side->partitionStart, 0, (char **)&zone);
+        if(status != MIN_OK)
+        {
+            free(*entries);
+            *entries = NULL;
+            return status;
+        }
+        if(zone == NULL)
+            continue;
+
+        int used = containedFiles - (z * direntsPerZone);
+        if(used > direntsPerZone)
+            used = direntsPerZone;
+
+        int i;
+        for(i = 0; i < used; i++)
+        {
+            if(zone[i].inode == 0 || strcmp((char *)zone[i].name, ".") == 0 ||
+               strcmp((char *)zone[i].name, "..") == 0)
+                continue;
+
+            diffEntry *entry = &(*entries)[(*count)++];
+            size_t length =
+                strnlen((char *)zone[i].name, sizeof(zone[i].name));
+            memcpy(entry->name, zone[i].name, length);
+            entry->name[length] = '\0';
+            entry->inode = zone[i].inode;
+        }
+
+        free(zone);
+    }
+
+    qsort(*entries, *count, sizeof(diffEntry), compareEntries);
+
+    return MIN_OK;
+}
+
+/* Prints an added or removed path for each entry below a directory */
+int reportVisitor(char *path, uint32_t number, inode *file, void *arg)
+{
+    char *kind = (char *)arg;
+    printf("%c %s\n", *kind, path);
+    return 0;
+}
+
+/* Reports a path that exists on one side only, with everything below it */
+int reportTree(diffState *state, char kind, diffSide *side, char *path,
+               inode *file)
+{
+    printf("%c %s\n", kind, path);
+    state->changes++;
+
+    if(!isDirectory(file))
+        return MIN_OK;
+
+    return walkTree(path, file, side->image, side->sb, side->partitionStart, 0,
+                    reportVisitor, &kind);
+}
+
+int diffDirectory(diffState *state, char *path, diffSide *a, inode *dirA,
+                  diffSide *b, inode *dirB, int depth);
+
+/* Marks a directory as entered; reaching one twice means the tree loops */
+int enterDirectory(diffSide *side, uint32_t number)
+{
+    if(number > side->sb->ninodes ||
+       (side->visited[number / 8] & (1 << (number % 8))))
+        return MIN_ERR_CORRUPT;
+
+    side->visited[number / 8] |= 1 << (number % 8);
+    return MIN_OK;
+}
+
+/* Compares one path present in both images */
+int diffPath(diffState *state, char *path, diffSide *a, uint32_t numberA,
+             inode *fileA, diffSide *b, uint32_t numberB, inode *fileB,
+             int depth)
+{
+    /* A change of type is a removal and an addition */
+    if((fileA->mode & MODE_TYPE) != (fileB->mode & MODE_TYPE))
+    {
+        int status = reportTree(state, 'D', a, path, fileA);
+        if(status == MIN_OK)
+            status = reportTree(state, 'A', b, path, fileB);
+        return status;
+    }
+
+    /* Metadata first; file data is only read if it could have changed */
+    char changed[64] = "";
+    if(fileA->mode != fileB->mode)
+        strcat(changed, " mode");
+    if(fileA->uid != fileB->uid)
+        strcat(changed, " uid");
+    if(fileA->gid != fileB->gid)
+        strcat(changed, " gid");
+    if(fileA->links != fileB->links)
+        strcat(changed, " links");
+    if(fileA->mtime != fileB->mtime)
+        strcat(changed, " mtime");
+
+    uint16_t type = fileA->mode & MODE_TYPE;
+    int status = MIN_OK;
+
+    if(type == MODE_CHAR || type == MODE_BLOCK)
+    {
+        if(fileA->zone[0] != fileB->zone[0])
+            strcat(changed, " device");
+    }
+    else if(!isDirectory(fileA))
+    {
+        if(fileA->size != fileB->size)
+        {
+            strcat(changed, " size data");
+        }
+        else if(changed[0] != '\0')
+        {
+            int differs;
+            status = compareData(state, a, fileA, b, fileB, &differs);
+            if(status != MIN_OK)
+                return status;
+            if(differs)
+                strcat(changed, " data");
+        }
+    }
+
+    if(changed[0] != '\0')
+    {
+        printf("M %s (%s)\n", path, changed + 1);
+        state->changes++;
+    }
+
+    /* Files deep in a directory can change without touching it */
+    if(isDirectory(fileA))
+    {
+        status = enterDirectory(a, numberA);
+        if(status == MIN_OK)
+            status = enterDirectory(b, numberB);
+        if(status == MIN_OK)
+            status =
+                diffDirectory(state, path, a, fileA, b, fileB, depth + 1);
+        else
+            fprintf(stderr, "ERROR: %s loops back into the tree\n", path);
+    }
+
+    return status;
+}
+
+/* Walks two directories in lockstep over their sorted entries */
+int diffDirectory(diffState *state, char *path, diffSide *a, inode *dirA,
+                  diffSide *b, inode *dirB, int depth)
+{
+    /* Guard against directory loops in corrupt images */
+    if(depth > MAX_TREE_DEPTH)
+    {
+        fprintf(stderr, "WARNING: %s is nested too deeply, skipping\n", path);
+        return MIN_OK;
+    }
+
+    diffEntry *entriesA;
+    diffEntry *entriesB;
+    int countA;
+    int countB;
+
+    int status = readEntries(a, dirA, &entriesA, &countA);
+    if(status != MIN_OK)
+        return status;
+    status = readEntries(b, dirB, &entriesB, &countB);
+    if(status != MIN_OK)
+    {
+        free(entriesA);
+        return status;
+    }
+
+    size_t pathLength = strlen(path);
+    char *childPath = malloc(pathLength + sizeof(((dirent *)0)->name) + 2);
+    if(childPath == NULL)
+    {
+        free(entriesA);
+        free(entriesB);
+        return MIN_ERR_NOMEM;
+    }
+    strcpy(childPath, path);
+    if(pathLength == 0 || path[pathLength - 1] != '/')
+        childPath[pathLength++] = '/';
+
+    int i = 0;
+    int j = 0;
+    while((i < countA || j < countB) && status == MIN_OK)
+    {
+        int order;
+        if(i == countA)
+            order = 1;
+        else if(j == countB)
+            order = -1;
+        else
+            order = strcmp(entriesA[i].name, entriesB[j].name);
+
+        strcpy(childPath + pathLength,
+               order <= 0 ? entriesA[i].name : entriesB[j].name);
+
+        inode *fileA = NULL;
+        inode *fileB = NULL;
+        uint32_t numberA = order <= 0 ? entriesA[i].inode : 0;
+        uint32_t numberB = order >= 0 ? entriesB[j].inode : 0;
+        if(order <= 0)
+            status = getInode(entriesA[i++].inode, a->image, a->sb,
+                              a->partitionStart, state->verbose, &fileA);
+        if(order >= 0 && status == MIN_OK)
+            status = getInode(entriesB[j++].inode, b->image, b->sb,
+                              b->partitionStart, state->verbose, &fileB);
+
+        if(status == MIN_OK)
+        {
+            if(order < 0)
+                status = reportTree(state, 'D', a, childPath, fileA);
+            else if(order > 0)
+                status = reportTree(state, 'A', b, childPath, fileB);
+            else
+                status = diffPath(state, childPath, a, numberA, fileA, b,
+                                  numberB, fileB, depth);
+        }
+
+        free(fileA);
+        free(fileB);
+    }
+
+    free(childPath);
+    free(entriesA);
+    free(entriesB);
+
+    return status;
+}
+
+/* Opens an image and the filesystem selected in it */
+int openSide(diffSide *side, char *filename, int usePartition, int useSubpart)
+{
+    side->filename = filename;
+    side->image = openImage(filename);
+    if(side->image == NULL)
+    {
+        fprintf(stderr, "ERROR: %s: file not found!\n", filename);
+        return -1;
+    }
+
+    int status = openFilesystem(side->image, usePartition, useSubpart,
+                                &side->partitionStart, &side->sb);
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s:\n", filename);
+        printOpenError(status, side->sb);
+        fclose(side->image);
+        return -1;
+    }
+
+    side->zonesize = side->sb->blocksize << side->sb->log_zone_size;
+    side->visited = (uint8_t *)calloc(side->sb->ninodes / 8 + 1, 1);
+    if(side->visited == NULL)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(MIN_ERR_NOMEM));
+        free(side->sb);
+        fclose(side->image);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Prints program usage information */
+void printUsage()
+{
+    fprintf(
+        stderr,
+        "usage: mindiff [ -v ] [ -q ] [ -p num [ -s num ] ] [ -P num [ -S num ]"
+        " ]\n"
+        "               imagefile1 imagefile2 [ path ]\n"
+        "Prints A, D or M for each added, removed or modified path.\n"
+        "Options:\n"
+        "-p part    --- select partition in the first image (default: none)\n"
+        "-s sub     --- select subpartition in the first image\n"
+        "-P part    --- select partition in the second image (default: none)\n"
+        "-S sub     --- select subpartition in the second image\n"
+        "-q quick   --- assume zones with matching numbers are unchanged\n"
+        "-h help    --- print usage information and exit\n"
+        "-v verbose --- increase verbosity level\n");
+}
+
+/* Parses a partition or subpartition number */
+int parsePartition(char *text, char *what)
+{
+    int value = atoi(text);
+    if(value < 0 || value > 3)
+    {
+        fprintf(stderr, "ERROR: %s must be in the range 0-3.\n", what);
+        return -2;
+    }
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    /* If no arguments specified, print usage */
+    if(argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+
+    char *path = "/";
+
+    int usePartition[2] = {-1, -1};
+    int useSubpart[2] = {-1, -1};
+
+    diffState state;
+    state.verbose = 0;
+    state.trustZones = 0;
+    state.changes = 0;
+    state.zonesSkipped = 0;
+    state.zonesRead = 0;
+
+    /* Loop through argument flags */
+    int c;
+    while((c = getopt(argc, argv, "hvqp:s:P:S:")) != -1)
+    {
+        int side = (c == 'P' || c == 'S');
+
+        switch(c)
+        {
+        /* Partition is specified */
+        case 'p':
+        case 'P':
+            usePartition[side] = parsePartition(optarg, "partition");
+            if(usePartition[side] < -1)
+                return -1;
+            break;
+        /* Subpartition is specified */
+        case 's':
+        case 'S':
+            if(usePartition[side] == -1)
+            {
+                fprintf(stderr, "ERROR: cannot set subpartition unless main "
+                                "partition is specified.\n");
+                return -1;
+            }
+            useSubpart[side] = parsePartition(optarg, "subpartition");
+            if(useSubpart[side] < -1)
+                return -1;
+            break;
+        /* Skip zones whose numbers match */
+        case 'q':
+            state.trustZones = 1;
+            break;
+        /* Help flag */
+        case 'h':
+            printUsage();
+            return -1;
+        /* Verbose mode enabled */
+        case 'v':
+            state.verbose = 1;
+            break;
+        }
+    }
+
+    /* Get image filenames */
+    if(optind + 1 >= argc)
+    {
+        fprintf(stderr, "ERROR: two image names required.\n");
+        printUsage();
+        return -1;
+    }
+    /* Get path (if specified) */
+    if(optind + 2 < argc)
+    {
+        path = argv[optind + 2];
+    }
+
+    diffSide a;
+    diffSide b;
+    if(openSide(&a, argv[optind], usePartition[0], useSubpart[0]) != 0)
+        return -1;
+    if(openSide(&b, argv[optind + 1], usePartition[1], useSubpart[1]) != 0)
+        return -1;
+
+    inode *topA;
+    inode *topB;
+    uint32_t numberA;
+    uint32_t numberB;
+    int status = findFileNumber(path, a.image, a.sb, a.partitionStart,
+                                state.verbose, &numberA, &topA);
+    if(status == MIN_OK)
+    {
+        status = findFileNumber(path, b.image, b.sb, b.partitionStart,
+                                state.verbose, &numberB, &topB);
+        if(status != MIN_OK)
+            free(topA);
+    }
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+
+    status = diffPath(&state, path, &a, numberA, topA, &b, numberB, topB, 0);
+
+    if(status != MIN_OK)
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+
+    if(state.verbose == 1)
+        fprintf(stderr, "%llu changes, %llu zones read, %llu zones skipped\n",
+                (unsigned long long)state.changes,
+                (unsigned long long)state.zonesRead,
+                (unsigned long long)state.zonesSkipped);
+
+    free(topA);
+    free(topB);
+    free(a.visited);
+    free(b.visited);
+    free(a.sb);
+    free(b.sb);
+    fclose(a.image);
+    fclose(b.image);
+
+    if(status != MIN_OK)
+        return -1;
+
+    return state.changes ? 1 : 0;
+}
@@ -0,0 +1,485 @@
+#include "minimage.h"
+#include "minutil.h"
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MODE_TYPE 0170000
+
+/* Output formats for matching paths */
+#define OUTPUT_LINES 0
+#define OUTPUT_NUL 1
+#define OUTPUT_JSON 2
+
+/* Inclusive range of accepted values */
+typedef struct range
+{
+    long long min;
+    long long max;
+} range;
+
+/* The search predicates; unset ones accept everything */
+typedef struct findOptions
+{
+    char *name;       /* glob matched against the last path component */
+    char *prune;      /* glob of directory names not to descend into */
+    uint16_t type;    /* file type bits, or 0 for any */
+    range size;
+    range mtime;
+    range uid;
+    range gid;
+    range links;
+    int maxDepth;     /* deepest level to visit, or -1 for no limit */
+    int baseDepth;    /* slashes in the starting path */
+    int output;
+    uint64_t matches;
+} findOptions;
+
+/* Maps a find-style type letter to its file type bits */
+uint16_t typeBits(char letter)
+{
+    switch(letter)
+    {
+    case 'f':
+        return 0100000;
+    case 'd':
+        return 0040000;
+    case 'l':
+        return 0120000;
+    case 'c':
+        return 0020000;
+    case 'b':
+        return 0060000;
+    case 'p':
+        return 0010000;
+    }
+
+    return 0;
+}
+
+/* Maps file type bits back to their type letter */
+char typeLetter(uint16_t mode)
+{
+    switch(mode & MODE_TYPE)
+    {
+    case 0100000:
+        return 'f';
+    case 0040000:
+        return 'd';
+    case 0120000:
+        return 'l';
+    case 0020000:
+        return 'c';
+    case 0060000:
+        return 'b';
+    case 0010000:
+        return 'p';
+    }
+
+    return '?';
+}
+
+/* Parses one bound of a range, allowing k, M and G suffixes if asked */
+int parseBound(char *text, char *end, int allowSuffix, long long *value)
+{
+    char *stop;
+    *value = strtoll(text, &stop, 10);
+    if(stop == text)
+        return -1;
+
+    if(allowSuffix && stop < end)
+    {
+        switch(*stop++)
+        {
+        case 'k':
+            *value *= 1024LL;
+            break;
+        case 'M':
+            *value *= 1024LL * 1024;
+            break;
+        case 'G':
+            *value *= 1024LL * 1024 * 1024;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return stop == end ? 0 : -1;
+}
+
+/* Parses "n", "min:max", "min:" or ":max" into a range */
+int parseRange(char *text, int allowSuffix, range *out)
+{
+    char *colon = strchr(text, ':');
+    char *end = text + strlen(text);
+
+    if(colon == NULL)
+    {
+        if(parseBound(text, end, allowSuffix, &out->min) != 0)
+            return -1;
+        out->max = out->min;
+        return 0;
+    }
+
+    out->min = LLONG_MIN;
+    out->max = LLONG_MAX;
+    if(colon > text && parseBound(text, colon, allowSuffix, &out->min) != 0)
+        return -1;
+    if(colon + 1 < end &&
+       parseBound(colon + 1, end, allowSuffix, &out->max) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Checks a value against a range */
+int inRange(range *bounds, long long value)
+{
+    return value >= bounds->min && value <= bounds->max;
+}
+
+/* Writes a string as a JSON string literal */
+void writeJsonString(const char *text)
+{
+    putchar('"');
+    for(; *text; text++)
+    {
+        unsigned char c = *text;
+        if(c == '"' || c == '\\')
+        {
+            putchar('\\');
+            putchar(c);
+        }
+        else if(c < 0x20)
+        {
+            printf("\\u%04x", c);
+        }
+        else
+        {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/* Writes one matching path in the selected output format */
+void writeMatch(findOptions *options, char *path, uint32_t number,
+                inode *file)
+{
+    options->matches++;
+
+    switch(options->output)
+    {
+    case OUTPUT_NUL:
+        fputs(path, stdout);
+        putchar('\0');
+        break;
+    case OUTPUT_JSON:
+        printf("{\"path\":");
+        writeJsonString(path);
+        printf(",\"inode\":%u,\"type\":\"%c\",\"mode\":%u,\"size\":%u,"
+               "\"uid\":%u,\"gid\":%u,\"links\":%u,\"mtime\":%d}\n",
+               number, typeLetter(file->mode), file->mode & 07777, file->size,
+               file->uid, file->gid, file->links, file->mtime);
+        break;
+    default:
+        puts(path);
+        break;
+    }
+}
+
+/* Counts the slashes in a path, ignoring a trailing one */
+int pathDepth(char *path)
+{
+    int depth = 0;
+    size_t length = strlen(path);
+
+    if(length > 0 && path[length - 1] == '/')
+        length--;
+
+    size_t i;
+    for(i = 0; i < length; i++)
+        depth += path[i] == '/';
+
+    return depth;
+}
+
+/* Tests an entry against the predicates; every test only needs the inode
+   and name, so no file data is ever read */
+int findVisitor(char *path, uint32_t number, inode *file, void *arg)
+{
+    findOptions *options = (findOptions *)arg;
+
+    char *name = strrchr(path, '/');
+    name = (name != NULL && name[1] != '\0') ? name + 1 : path;
+
+    int depth = pathDepth(path) - options->baseDepth;
+    int isDir = isDirectory(file);
+
+    /* Pruned directories are neither reported nor descended into */
+    if(isDir && options->prune != NULL && depth > 0 &&
+       fnmatch(options->prune, name, 0) == 0)
+        return 1;
+
+    /* Cheap integer tests first, the name glob last */
+    if((options->type == 0 || (file->mode & MODE_TYPE) == options->type) &&
+       inRange(&options->uid, file->uid) && inRange(&options->gid, file->gid) &&
+       inRange(&options->links, file->links) &&
+       inRange(&options->size, file->size) &&
+       inRange(&options->mtime, file->mtime) &&
+       (options->name == NULL || fnmatch(options->name, name, 0) == 0))
+        writeMatch(options, path, number, file);
+
+    /* Stop descending at the depth limit */
+    if(isDir && options->maxDepth >= 0 && depth >= options->maxDepth)
+        return 1;
+
+    return 0;
+}
+
+/* Prints program usage information */
+void printUsage()
+{
+    fprintf(
+        stderr,
+        "usage: minfind [ -v ] [ -p num [ -s num ] ] [ -0 | -j ] [ -n glob ]"
+        " [ -t type ]\n"
+        "               [ -z size ] [ -m mtime ] [ -u uid ] [ -g gid ]"
+        " [ -l links ]\n"
+        "               [ -d depth ] [ -x glob ] imagefile [ path ]\n"
+        "Ranges are given as n, min:max, min: or :max.\n"
+        "Options:\n"
+        "-p part    --- select partition for filesystem (default: none)\n"
+        "-s sub     --- select subpartition for filesystem (default: none)\n"
+        "-0         --- separate paths with NUL instead of newline\n"
+        "-j         --- print one JSON object per match\n"
+        "-n glob    --- match the file name against a glob\n"
+        "-t type    --- match the file type (f, d, l, c, b or p)\n"
+        "-z size    --- match a size range in bytes (k, M, G suffixes)\n"
+        "-m mtime   --- match a modification time range in epoch seconds\n"
+        "-u uid     --- match an owner range\n"
+        "-g gid     --- match a group range\n"
+        "-l links   --- match a link count range\n"
+        "-d depth   --- do not descend more than depth levels\n"
+        "-x glob    --- do not descend into directories matching glob\n"
+        "-h help    --- print usage information and exit\n"
+        "-v verbose --- increase verbosity level\n");
+}
+
+int main(int argc, char **argv)
+{
+    /* If no arguments specified, print usage */
+    if(argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+
+    char *filename = NULL;
+    char *path = "/";
+
+    int verbose = 0;
+    int usePartition = -1;
+    int useSubpart = -1;
+
+    range any = {LLONG_MIN, LLONG_MAX};
+    findOptions options;
+    options.name = NULL;
+    options.prune = NULL;
+    options.type = 0;
+    options.size = any;
+    options.mtime = any;
+    options.uid = any;
+    options.gid = any;
+    options.links = any;
+    options.maxDepth = -1;
+    options.output = OUTPUT_LINES;
+    options.matches = 0;
+
+    /* Loop through argument flags */
+    int c;
+    while((c = getopt(argc, argv, "hvp:s:0jn:t:z:m:u:g:l:d:x:")) != -1)
+    {
+        range *target = NULL;
+        int allowSuffix = 0;
+
+        switch(c)
+        {
+        /* Partition is specified */
+        case 'p':
+            usePartition = atoi(optarg);
+            if(usePartition < 0 || usePartition > 3)
+            {
+                fprintf(stderr, "ERROR: partition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Subpartition is specified */
+        case 's':
+            if(usePartition == -1)
+            {
+                fprintf(stderr, "ERROR: cannot set subpartition unless main "
+                                "partition is specified.\n");
+                return -1;
+            }
+            useSubpart = atoi(optarg);
+            if(useSubpart < 0 || useSubpart > 3)
+            {
+                fprintf(stderr,
+                        "ERROR: subpartition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Output formats */
+        case '0':
+            options.output = OUTPUT_NUL;
+            break;
+        case 'j':
+            options.output = OUTPUT_JSON;
+            break;
+        /* Name and prune globs */
+        case 'n':
+            options.name = optarg;
+            break;
+        case 'x':
+            options.prune = optarg;
+            break;
+        /* File type */
+        case 't':
+            options.type = typeBits(optarg[0]);
+            if(options.type == 0 || optarg[1] != '\0')
+            {
+                fprintf(stderr, "ERROR: type must be one of f, d, l, c, b "
+                                "or p.\n");
+                return -1;
+            }
+            break;
+        /* Ranges */
+        case 'z':
+            target = &options.size;
+            allowSuffix = 1;
+            break;
+        case 'm':
+            target = &options.mtime;
+            break;
+        case 'u':
+            target = &options.uid;
+            break;
+        case 'g':
+            target = &options.gid;
+            break;
+        case 'l':
+            target = &options.links;
+            break;
+        /* Depth limit */
+        case 'd':
+            options.maxDepth = atoi(optarg);
+            if(options.maxDepth < 0)
+            {
+                fprintf(stderr, "ERROR: depth must not be negative.\n");
+                return -1;
+            }
+            break;
+        /* Help flag */
+        case 'h':
+            printUsage();
+            return -1;
+        /* Verbose mode enabled */
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            printUsage();
+            return -1;
+        }
+
+        if(target != NULL && parseRange(optarg, allowSuffix, target) != 0)
+        {
+            fprintf(stderr, "ERROR: invalid range '%s' for -%c.\n", optarg, c);
+            return -1;
+        }
+    }
+
+    /* Get image filename */
+    if(optind < argc)
+    {
+        filename = argv[optind];
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: image name required.\n");
+        printUsage();
+        return -1;
+    }
+    /* Get path (if specified) */
+    if(optind + 1 < argc)
+    {
+        path = argv[optind + 1];
+    }
+
+    /* Open image file */
+    FILE *image = openImage(filename);
+    if(image == NULL)
+    {
+        fprintf(stderr, "ERROR: file not found!\n");
+        return -1;
+    }
+
+    /* Enter the selected partition and read its superblock */
+    uint64_t partitionStart;
+    superblock *sb;
+    int status =
+        openFilesystem(image, usePartition, useSubpart, &partitionStart, &sb);
+    if(status != MIN_OK)
+    {
+        printOpenError(status, sb);
+        return -1;
+    }
+
+    uint32_t number;
+    inode *top;
+    status = findFileNumber(path, image, sb, partitionStart, verbose, &number,
+                            &top);
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+
+    /* Matches go out in large writes to keep up with a consumer */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    options.baseDepth = pathDepth(path);
+
+    /* The starting path is tested like any other entry, as in find(1) */
+    status = findVisitor(path, number, top, &options);
+    if(status == 0 && isDirectory(top))
+    {
+        status = walkTree(path, top, image, sb, partitionStart, verbose,
+                          findVisitor, &options);
+    }
+    else
+    {
+        status = MIN_OK;
+    }
+
+    if(fflush(stdout) != 0 && status == MIN_OK)
+        status = MIN_ERR_WRITE;
+
+    if(status != MIN_OK)
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+
+    if(verbose == 1)
+        fprintf(stderr, "%llu matches\n", (unsigned long long)options.matches);
+
+    free(top);
+    free(sb);
+    fclose(image);
+
+    return status == MIN_OK ? 0 : -1;
+}
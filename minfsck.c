@@ -0,0 +1,629 @@
+#include "minimage.h"
+#include "minutil.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MODE_TYPE 0170000
+#define MODE_CHAR 0020000
+#define MODE_BLOCK 0060000
+
+/* Everything the passes share; read-only once the passes start */
+typedef struct fsckContext
+{
+    char *filename;
+    uint64_t partitionStart;
+    uint64_t imageSize; /* bytes available from partitionStart onwards */
+    superblock *sb;
+    uint32_t zonesize;
+    uint32_t linksPerBlock; /* zone numbers per indirect block */
+    inode *inodes;          /* whole inode table; inodes[0] is inode 1 */
+    uint8_t *inodeMap;      /* on-disk inode bitmap */
+    uint8_t *zoneMap;       /* on-disk zone bitmap */
+    int verbose;
+} fsckContext;
+
+/* Problems found by one pass, collected so output is not interleaved */
+typedef struct passLog
+{
+    FILE *stream;
+    char *text;
+    size_t length;
+    int problems;
+} passLog;
+
+/* Arguments and results of the inode table pass */
+typedef struct tablePass
+{
+    fsckContext *ctx;
+    passLog log;
+    FILE *image;
+    uint32_t *zoneOwner; /* inode owning each zone, 0 if unreferenced */
+} tablePass;
+
+/* Arguments and results of the directory tree pass */
+typedef struct treePass
+{
+    fsckContext *ctx;
+    passLog log;
+    FILE *image;
+    uint32_t *linkCount; /* directory entries referencing each inode */
+} treePass;
+
+/* Checks whether a bit is set in a bitmap */
+int testBit(uint8_t *map, uint32_t bit)
+{
+    return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* Sets a bit in a bitmap */
+void setBit(uint8_t *map, uint32_t bit)
+{
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+/* Records a problem in a pass log */
+void report(passLog *log, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void report(passLog *log, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(log->stream, format, args);
+    va_end(args);
+    fputc('\n', log->stream);
+    log->problems++;
+}
+
+/* Opens a pass log */
+void openLog(passLog *log)
+{
+    log->text = NULL;
+    log->length = 0;
+    log->problems = 0;
+    log->stream = open_memstream(&log->text, &log->length);
+    if(log->stream == NULL)
+    {
+        fprintf(stderr, "ERROR: could not allocate memory for log!\n");
+        exit(-1);
+    }
+}
+
+/* Checks that a byte range lies inside the filesystem image */
+int inImage(fsckContext *ctx, uint64_t start, uint64_t size)
+{
+    return start + size <= ctx->imageSize;
+}
+
+/* Checks that a zone number points into the data area */
+int validZone(fsckContext *ctx, uint32_t zone)
+{
+    return zone >= ctx->sb->firstdata && zone < ctx->sb->zones &&
+           inImage(ctx, (uint64_t)zone * ctx->zonesize, ctx->zonesize);
+}
+
+/* Reads the zone numbers stored in an indirect zone */
+int readIndirect(fsckContext *ctx, FILE *image, uint32_t zone,
+                 uint32_t **links)
+{
+    return getData((uint64_t)zone * ctx->zonesize,
+                   ctx->linksPerBlock * sizeof(uint32_t), image,
+                   ctx->partitionStart, (unsigned char **)links);
+}
+
+/* Claims a zone for an inode, reporting range errors and cross-links */
+int claimZone(tablePass *pass, uint32_t number, uint32_t zone,
+              const char *where)
+{
+    fsckContext *ctx = pass->ctx;
+
+    if(!validZone(ctx, zone))
+    {
+        report(&pass->log, "inode %u: %s zone %u out of range", number, where,
+               zone);
+        return 0;
+    }
+
+    if(pass->zoneOwner[zone] != 0)
+    {
+        report(&pass->log, "inode %u: %s zone %u cross-linked with inode %u",
+               number, where, zone, pass->zoneOwner[zone]);
+        return 0;
+    }
+
+    pass->zoneOwner[zone] = number;
+    return 1;
+}
+
+/* Claims the data zones listed in an indirect zone */
+void claimIndirect(tablePass *pass, uint32_t number, uint32_t zone,
+                   int doubly)
+{
+    if(!claimZone(pass, number, zone,
+                  doubly ? "double indirect" : "indirect"))
+        return;
+
+    uint32_t *links;
+    int status = readIndirect(pass->ctx, pass->image, zone, &links);
+    if(status != MIN_OK)
+    {
+        report(&pass->log, "inode %u: zone %u: %s", number, zone,
+               minErrorString(status));
+        return;
+    }
+
+    uint32_t i;
+    for(i = 0; i < pass->ctx->linksPerBlock; i++)
+    {
+        if(links[i] == 0)
+            continue;
+
+        if(doubly)
+            claimIndirect(pass, number, links[i], 0);
+        else
+            claimZone(pass, number, links[i], "data");
+    }
+
+    free(links);
+}
+
+/* Inode table pass: inode bitmap, zone ranges, cross-links, zone bitmap */
+void *runTablePass(void *arg)
+{
+    tablePass *pass = (tablePass *)arg;
+    fsckContext *ctx = pass->ctx;
+    superblock *sb = ctx->sb;
+
+    uint32_t number;
+    for(number = 1; number <= sb->ninodes; number++)
+    {
+        inode *file = &ctx->inodes[number - 1];
+        int allocated = file->mode != 0;
+        int marked = testBit(ctx->inodeMap, number);
+
+        if(allocated && !marked)
+            report(&pass->log, "inode %u: in use but free in inode bitmap",
+                   number);
+        else if(!allocated && marked)
+            report(&pass->log, "inode %u: marked in bitmap but not in use",
+                   number);
+
+        /* Device files keep a device number in zone[0] */
+        if(!allocated || (file->mode & MODE_TYPE) == MODE_CHAR ||
+           (file->mode & MODE_TYPE) == MODE_BLOCK)
+            continue;
+
+        int i;
+        for(i = 0; i < DIRECT_ZONES; i++)
+        {
+            if(file->zone[i] != 0)
+                claimZone(pass, number, file->zone[i], "direct");
+        }
+        if(file->indirect != 0)
+            claimIndirect(pass, number, file->indirect, 0);
+        if(file->two_indirect != 0)
+            claimIndirect(pass, number, file->two_indirect, 1);
+    }
+
+    /* Bit 1 of the zone bitmap is the first data zone */
+    uint32_t zone;
+    for(zone = sb->firstdata; zone < sb->zones; zone++)
+    {
+        int marked = testBit(ctx->zoneMap, zone - sb->firstdata + 1);
+
+        if(pass->zoneOwner[zone] != 0 && !marked)
+            report(&pass->log, "zone %u: used by inode %u but free in zone "
+                               "bitmap",
+                   zone, pass->zoneOwner[zone]);
+        else if(pass->zoneOwner[zone] == 0 && marked)
+            report(&pass->log, "zone %u: marked in bitmap but unreferenced",
+                   zone);
+    }
+
+    return NULL;
+}
+
+/* Finds the zone holding a directory's logical zone, or 0 if unusable */
+uint32_t lookupZone(fsckContext *ctx, zoneCursor *cursor, int index)
+{
+    uint32_t zone;
+    if(getCursorZone(cursor, index, &zone) != MIN_OK)
+        return 0;
+
+    return validZone(ctx, zone) ? zone : 0;
+}
+
+/* Directory tree pass: entry validity, tree shape and link counts */
+void *runTreePass(void *arg)
+{
+    treePass *pass = (treePass *)arg;
+    fsckContext *ctx = pass->ctx;
+    superblock *sb = ctx->sb;
+
+    uint8_t *visited = (uint8_t *)calloc(sb->ninodes / 8 + 1, 1);
+
+    /* Every directory zone is read into the same buffer */
+    dirent *entries = (dirent *)malloc(ctx->zonesize);
+
+    /* Explicit stack of (directory, parent) pairs still to scan */
+    uint32_t *stack = (uint32_t *)malloc(2 * sizeof(uint32_t) * sb->ninodes);
+    if(visited == NULL || entries == NULL || stack == NULL)
+    {
+        fprintf(stderr, "ERROR: could not allocate memory for tree pass!\n");
+        exit(-1);
+    }
+
+    int depth = 0;
+    if(ctx->inodes[0].mode != 0 && isDirectory(&ctx->inodes[0]))
+    {
+        stack[depth++] = 1;
+        stack[depth++] = 1;
+        setBit(visited, 1);
+    }
+    else
+    {
+        report(&pass->log, "inode 1: root is not a directory");
+    }
+
+    int direntsPerZone = ctx->zonesize / sizeof(dirent);
+
+    while(depth > 0)
+    {
+        uint32_t parent = stack[--depth];
+        uint32_t number = stack[--depth];
+        inode *dir = &ctx->inodes[number - 1];
+
+        int containedFiles = dir->size / sizeof(dirent);
+        int totalZones = (containedFiles + direntsPerZone - 1) / direntsPerZone;
+        int sawSelf = 0, sawParent = 0;
+
+        zoneCursor cursor;
+        openZoneCursor(&cursor, dir, pass->image, sb, ctx->partitionStart);
+
+        int z;
+        for(z = 0; z < totalZones; z++)
+        {
+            /* Bad zones are reported by the table pass */
+            uint32_t zone = lookupZone(ctx, &cursor, z);
+            if(zone == 0)
+                continue;
+
+            int status = readData((uint64_t)zone * ctx->zonesize,
+                                  ctx->zonesize, pass->image,
+                                  ctx->partitionStart,
+                                  (unsigned char *)entries);
+            if(status != MIN_OK)
+            {
+                report(&pass->log, "inode %u: zone %u: %s", number, zone,
+                       minErrorString(status));
+                continue;
+            }
+
+            int count = containedFiles - (z * direntsPerZone);
+            if(count > direntsPerZone)
+                count = direntsPerZone;
+
+            int i;
+            for(i = 0; i < count; i++)
+            {
+                uint32_t child = entries[i].inode;
+                char name[sizeof(entries[i].name) + 1];
+                memcpy(name, entries[i].name, sizeof(entries[i].name));
+                name[sizeof(entries[i].name)] = '\0';
+
+                if(child == 0)
+                    continue;
+
+                if(child > sb->ninodes)
+                {
+                    report(&pass->log,
+                           "inode %u: entry \"%s\" has invalid inode %u",
+                           number, name, child);
+                    continue;
+                }
+
+                pass->linkCount[child]++;
+
+                inode *target = &ctx->inodes[child - 1];
+                if(target->mode == 0)
+                {
+                    report(&pass->log,
+                           "inode %u: entry \"%s\" refers to free inode %u",
+                           number, name, child);
+                    continue;
+                }
+
+                if(strcmp(name, ".") == 0)
+                {
+                    sawSelf = 1;
+                    if(child != number)
+                        report(&pass->log,
+                               "inode %u: \".\" refers to inode %u", number,
+                               child);
+                }
+                else if(strcmp(name, "..") == 0)
+                {
+                    sawParent = 1;
+                    if(child != parent)
+                        report(&pass->log,
+                               "inode %u: \"..\" refers to inode %u, "
+                               "expected %u",
+                               number, child, parent);
+                }
+                else if(isDirectory(target))
+                {
+                    if(testBit(visited, child))
+                    {
+                        report(&pass->log,
+                               "inode %u: directory \"%s\" (inode %u) "
+                               "already linked elsewhere",
+                               number, name, child);
+                    }
+                    else
+                    {
+                        setBit(visited, child);
+                        stack[depth++] = child;
+                        stack[depth++] = number;
+                    }
+                }
+            }
+        }
+
+        closeZoneCursor(&cursor);
+
+        if(!sawSelf)
+            report(&pass->log, "inode %u: directory has no \".\" entry",
+                   number);
+        if(!sawParent)
+            report(&pass->log, "inode %u: directory has no \"..\" entry",
+                   number);
+    }
+
+    free(stack);
+    free(entries);
+    free(visited);
+
+    return NULL;
+}
+
+/* Prints program usage information */
+void printUsage()
+{
+    fprintf(
+        stderr,
+        "usage: minfsck [ -v ] [ -p num [ -s num ] ] imagefile\n"
+        "Options:\n"
+        "-p part    --- select partition for filesystem (default: none)\n"
+        "-s sub     --- select subpartition for filesystem (default: none)\n"
+        "-h help    --- print usage information and exit\n"
+        "-v verbose --- increase verbosity level\n");
+}
+
+int main(int argc, char **argv)
+{
+    /* If no arguments specified, print usage */
+    if(argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+
+    int verbose = 0;
+    int usePartition = -1;
+    int useSubpart = -1;
+
+    /* Loop through argument flags */
+    int c;
+    while((c = getopt(argc, argv, "hvp:s:")) != -1)
+    {
+        switch(c)
+        {
+        /* Partition is specified */
+        case 'p':
+            usePartition = atoi(optarg);
+            if(usePartition < 0 || usePartition > 3)
+            {
+                fprintf(stderr, "ERROR: partition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Subpartition is specified */
+        case 's':
+            if(usePartition == -1)
+            {
+                fprintf(stderr, "ERROR: cannot set subpartition unless main "
+                                "partition is specified.\n");
+                return -1;
+            }
+            useSubpart = atoi(optarg);
+            if(useSubpart < 0 || useSubpart > 3)
+            {
+                fprintf(stderr,
+                        "ERROR: subpartition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Help flag */
+        case 'h':
+            printUsage();
+            return -1;
+        /* Verbose mode enabled */
+        case 'v':
+            verbose = 1;
+            break;
+        }
+    }
+
+    fsckContext ctx;
+    ctx.verbose = verbose;
+
+    /* Get image filename */
+    if(optind < argc)
+    {
+        ctx.filename = argv[optind];
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: image name required.\n");
+        printUsage();
+        return -1;
+    }
+
+    /* Open image file */
+    FILE *image = openImage(ctx.filename);
+    if(image == NULL)
+    {
+        fprintf(stderr, "ERROR: file not found!\n");
+        return -1;
+    }
+
+    int status = openFilesystem(image, usePartition, useSubpart,
+                                &ctx.partitionStart, &ctx.sb);
+    if(status != MIN_OK)
+    {
+        printOpenError(status, ctx.sb);
+        return -1;
+    }
+
+    superblock *sb = ctx.sb;
+
+    /* Seeking to the end also works for compressed images */
+    off_t imageEnd = -1;
+    if(fseeko(image, 0, SEEK_END) == 0)
+        imageEnd = ftello(image);
+    if(imageEnd < 0 || (uint64_t)imageEnd < ctx.partitionStart)
+    {
+        fprintf(stderr, "ERROR: could not get image size!\n");
+        return -1;
+    }
+    ctx.imageSize = imageEnd - ctx.partitionStart;
+
+    /* Reject geometry the passes cannot safely index with; the inode table
+       is read in one go, so it must fit a single read */
+    if(sb->blocksize < 1024 || (sb->blocksize & (sb->blocksize - 1)) != 0 ||
+       sb->log_zone_size < 0 || sb->log_zone_size > 8 || sb->ninodes == 0 ||
+       sb->i_blocks <= 0 || sb->z_blocks <= 0 ||
+       sb->firstdata >= sb->zones ||
+       (uint64_t)sb->ninodes * sizeof(inode) > UINT32_MAX)
+    {
+        fprintf(stderr, "ERROR: superblock geometry is invalid!\n");
+        return -1;
+    }
+
+    ctx.zonesize = sb->blocksize << sb->log_zone_size;
+    ctx.linksPerBlock = sb->blocksize / sizeof(uint32_t);
+
+    uint64_t inodeMapStart = 2 * (uint64_t)sb->blocksize;
+    uint64_t zoneMapStart = inodeMapStart + sb->i_blocks * sb->blocksize;
+    uint64_t tableStart = zoneMapStart + sb->z_blocks * sb->blocksize;
+    uint64_t tableSize = (uint64_t)sb->ninodes * sizeof(inode);
+
+    if((uint64_t)sb->i_blocks * sb->blocksize * 8 < sb->ninodes + 1 ||
+       (uint64_t)sb->z_blocks * sb->blocksize * 8 <
+           sb->zones - sb->firstdata + 1 ||
+       !inImage(&ctx, tableStart, tableSize))
+    {
+        fprintf(stderr, "ERROR: bitmaps or inode table do not fit!\n");
+        return -1;
+    }
+
+    /* Read the bitmaps and the whole inode table once, up front */
+    status = getData(inodeMapStart, sb->i_blocks * sb->blocksize, image,
+                     ctx.partitionStart, &ctx.inodeMap);
+    if(status == MIN_OK)
+        status = getData(zoneMapStart, sb->z_blocks * sb->blocksize, image,
+                         ctx.partitionStart, &ctx.zoneMap);
+    if(status == MIN_OK)
+        status = getData(tableStart, tableSize, image, ctx.partitionStart,
+                         (unsigned char **)&ctx.inodes);
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+
+    if(verbose)
+        printf("%u inodes, %u zones of %u bytes, first data zone %u\n",
+               sb->ninodes, sb->zones, ctx.zonesize, sb->firstdata);
+
+    /* Each pass reads through its own stream so they never share a file
+       position */
+    tablePass table;
+    table.ctx = &ctx;
+    table.image = openImage(ctx.filename);
+    table.zoneOwner = (uint32_t *)calloc(sb->zones, sizeof(uint32_t));
+    openLog(&table.log);
+
+    treePass tree;
+    tree.ctx = &ctx;
+    tree.image = openImage(ctx.filename);
+    tree.linkCount = (uint32_t *)calloc(sb->ninodes + 1, sizeof(uint32_t));
+    openLog(&tree.log);
+
+    if(table.image == NULL || tree.image == NULL || table.zoneOwner == NULL ||
+       tree.linkCount == NULL)
+    {
+        fprintf(stderr, "ERROR: could not set up checker passes!\n");
+        return -1;
+    }
+
+    pthread_t tableThread;
+    if(pthread_create(&tableThread, NULL, runTablePass, &table) != 0)
+    {
+        fprintf(stderr, "ERROR: could not start inode table pass!\n");
+        return -1;
+    }
+    runTreePass(&tree);
+    pthread_join(tableThread, NULL);
+
+    /* Link counts need both the tree walk and the inode table */
+    passLog links;
+    openLog(&links);
+
+    uint32_t number;
+    for(number = 1; number <= sb->ninodes; number++)
+    {
+        inode *file = &ctx.inodes[number - 1];
+        if(file->mode == 0)
+            continue;
+
+        if(tree.linkCount[number] == 0)
+            report(&links, "inode %u: in use but not in any directory",
+                   number);
+        else if(tree.linkCount[number] != file->links)
+            report(&links, "inode %u: link count is %u, found %u references",
+                   number, file->links, tree.linkCount[number]);
+    }
+
+    fclose(table.log.stream);
+    fclose(tree.log.stream);
+    fclose(links.stream);
+
+    fputs(table.log.text, stdout);
+    fputs(tree.log.text, stdout);
+    fputs(links.text, stdout);
+
+    int problems = table.log.problems + tree.log.problems + links.problems;
+    printf("%s: %d problem%s found\n", ctx.filename, problems,
+           problems == 1 ? "" : "s");
+
+    free(table.log.text);
+    free(tree.log.text);
+    free(links.text);
+    free(table.zoneOwner);
+    free(tree.linkCount);
+    fclose(table.image);
+    fclose(tree.image);
+    free(ctx.inodes);
+    free(ctx.zoneMap);
+    free(ctx.inodeMap);
+    free(sb);
+    fclose(image);
+
+    return problems ? 1 : 0;
+}
@@ -1,18 +1,885 @@
+#include "minhash.h"
+#include "minimage.h"
 #include "minutil.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+/* Files at least this big are hashed on a worker thread */
+#define HASH_THREAD_MIN (1024 * 1024)
+
+/* Hashes zones on its own thread while the next ones are read; zones are
+   copied into one of two buffers, so reading and hashing take turns on
+   them instead of waiting on each other */
+typedef struct hashWorker
+{
+    contentHash *hash;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;    /* a buffer was filled or emptied */
+    unsigned char *buffers[2]; /* zone sized */
+    uint32_t lengths[2];
+    int full[2];               /* buffer is waiting to be hashed */
+    int next;                  /* buffer the reader fills next */
+    int done;                  /* no more zones are coming */
+} hashWorker;
+
+/* An earlier extraction that holds some zone's contents */
+typedef struct zoneSource
+{
+    char digest[SHA256_HEX_SIZE];
+    uint32_t length;
+    uint64_t offset; /* where the zone starts in the file */
+    char *path;
+} zoneSource;
+
+/* What a mindedup index (-z) knows about the file being extracted */
+typedef struct zoneIndex
+{
+    char *path;                       /* index file, appended to afterwards */
+    char (*digests)[SHA256_HEX_SIZE]; /* per logical zone, "" if unknown */
+    int zoneCount;
+    zoneSource *sources;              /* sorted by digest */
+    int sourceCount;
+    FILE *openSource;                 /* source file last read from */
+    char *openPath;
+    uint64_t reusedBytes;             /* copied instead of read from image */
+} zoneIndex;
+
+/* State shared with the zone handler while extracting a file */
+typedef struct extractState
+{
+    FILE *out;          /* destination for streamed output */
+    char *tempPath;     /* file holding output until the digest is known */
+    uint32_t offset;    /* number of bytes received so far */
+    contentHash *hash;  /* running digest, or NULL if not hashing */
+    hashWorker *worker; /* thread doing the hashing, or NULL if inline */
+    zoneIndex *zones;   /* zones to copy from earlier output, or NULL */
+    int written;        /* the output reached dstpath */
+} extractState;
+
+/* Set of SHA-256 digests loaded from a manifest file */
+typedef struct manifest
+{
+    char (*digests)[SHA256_HEX_SIZE];
+    int count;
+} manifest;
+
+/* Command line settings that shape an extraction */
+typedef struct getOptions
+{
+    int verbose;
+    int printHash;
+    char *manifestPath;
+    char *indexPath; /* mindedup index of zones to reuse, or NULL */
+    char *imagePath;
+    int usePartition;
+    int useSubpart;
+    char *srcpath; /* used when extracting from every filesystem */
+    char *dstpath;
+} getOptions;
+
+/* Worker thread body: hashes buffers in the order they were filled */
+void *runHashWorker(void *arg)
+{
+    hashWorker *worker = (hashWorker *)arg;
+    int current = 0;
+
+    pthread_mutex_lock(&worker->lock);
+    while(1)
+    {
+        while(!worker->full[current] && !worker->done)
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        if(!worker->full[current])
+            break;
+
+        /* The reader only touches the other buffer meanwhile */
+        pthread_mutex_unlock(&worker->lock);
+        contentHashUpdate(worker->hash, worker->buffers[current],
+                          worker->lengths[current]);
+        pthread_mutex_lock(&worker->lock);
+
+        worker->full[current] = 0;
+        pthread_cond_signal(&worker->changed);
+        current ^= 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+/* Starts a worker hashing into hash; returns 0 if it could not */
+int startHashWorker(hashWorker *worker, contentHash *hash, uint32_t zonesize)
+{
+    memset(worker, 0, sizeof(hashWorker));
+    worker->hash = hash;
+    worker->buffers[0] = (unsigned char *)malloc(zonesize);
+    worker->buffers[1] = (unsigned char *)malloc(zonesize);
+
+    if(worker->buffers[0] == NULL || worker->buffers[1] == NULL)
+    {
+        free(worker->buffers[0]);
+        free(worker->buffers[1]);
+        return 0;
+    }
+
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->changed, NULL);
+
+    if(pthread_create(&worker->thread, NULL, runHashWorker, worker) != 0)
+    {
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->changed);
+        free(worker->buffers[0]);
+        free(worker->buffers[1]);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Hands a zone to the worker, waiting for a free buffer if need be */
+void feedHashWorker(hashWorker *worker, const unsigned char *data,
+                    uint32_t length)
+{
+    int slot = worker->next;
+
+    pthread_mutex_lock(&worker->lock);
+    while(worker->full[slot])
+        pthread_cond_wait(&worker->changed, &worker->lock);
+    pthread_mutex_unlock(&worker->lock);
+
+    memcpy(worker->buffers[slot], data, length);
+    worker->lengths[slot] = length;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->full[slot] = 1;
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+
+    worker->next = slot ^ 1;
+}
+
+/* Waits for the worker to hash everything it was given, then frees it */
+void stopHashWorker(hashWorker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    worker->done = 1;
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_join(worker->thread, NULL);
+
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->changed);
+    free(worker->buffers[0]);
+    free(worker->buffers[1]);
+}
+
+/* Hashes and writes out one zone of the extracted file */
+int extractZone(const unsigned char *data, uint32_t length, void *arg)
+{
+    extractState *state = (extractState *)arg;
+
+    /* Hash on the worker if there is one, otherwise while the zone is
+       still hot in cache */
+    if(state->worker != NULL)
+        feedHashWorker(state->worker, data, length);
+    else if(state->hash != NULL)
+        contentHashUpdate(state->hash, data, length);
+
+    if(fwrite(data, 1, length, state->out) != length)
+        return MIN_ERR_WRITE;
+
+    state->offset += length;
+    return 0;
+}
+
+/* Compares two digests for sorting and searching */
+int compareDigests(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/* Loads the digests listed in a manifest file (a missing file is empty) */
+void loadManifest(char *path, manifest *list)
+{
+    list->digests = NULL;
+    list->count = 0;
+
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+        return;
+
+    int capacity = 0;
+    char line[1024];
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        char digest[SHA256_HEX_SIZE];
+        if(sscanf(line, "%64s", digest) != 1 ||
+           strlen(digest) != SHA256_HEX_SIZE - 1)
+            continue;
+
+        if(list->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            list->digests =
+                realloc(list->digests, capacity * sizeof(*list->digests));
+            if(list->digests == NULL)
+            {
+                fprintf(stderr, "ERROR: could not allocate manifest!\n");
+                exit(-1);
+            }
+        }
+
+        strcpy(list->digests[list->count++], digest);
+    }
+
+    fclose(file);
+
+    qsort(list->digests, list->count, sizeof(*list->digests), compareDigests);
+}
+
+/* Checks whether a digest is listed in a manifest */
+int inManifest(manifest *list, char *digest)
+{
+    return list->count > 0 &&
+           bsearch(digest, list->digests, list->count, sizeof(*list->digests),
+                   compareDigests) != NULL;
+}
+
+/* Splits a zone reference line of a mindedup index:
+   "digest length image inode zone"; returns 0 if it is not one */
+int parseReference(char *line, char *digest, uint32_t *length, char **name,
+                   uint32_t *number, uint32_t *zone)
+{
+    int start = 0;
+    if(sscanf(line, "%64s %u %n", digest, length, &start) != 2 ||
+       start == 0 || strlen(digest) != SHA256_HEX_SIZE - 1)
+        return 0;
+
+    /* The image name may hold spaces, so take the numbers off the end */
+    line[strcspn(line, "\n")] = '\0';
+    char *last = strrchr(line + start, ' ');
+    if(last == NULL)
+        return 0;
+    *last = '\0';
+    char *middle = strrchr(line + start, ' ');
+    if(middle == NULL)
+        return 0;
+    *middle = '\0';
+
+    *name = line + start;
+    return sscanf(middle + 1, "%u", number) == 1 &&
+           sscanf(last + 1, "%u", zone) == 1;
+}
+
+/* Compares two zone sources by digest for sorting and searching */
+int compareSources(const void *a, const void *b)
+{
+    return strcmp(((const zoneSource *)a)->digest,
+                  ((const zoneSource *)b)->digest);
+}
+
+/* Reads what a mindedup index knows about one file: the digest of each of
+   its zones, if the index's stamp for the image is still current, and the
+   earlier extractions that hold any of those digests */
+void loadZoneIndex(zoneIndex *index, getOptions *options, uint32_t number,
+                   uint32_t zonesize, inode *file, char *dstpath)
+{
+    int zoneCount = (file->size + (uint64_t)zonesize - 1) / zonesize;
+
+    memset(index, 0, sizeof(zoneIndex));
+    index->path = options->indexPath;
+    index->zoneCount = zoneCount;
+    index->digests = calloc(zoneCount ? zoneCount : 1, SHA256_HEX_SIZE);
+    if(index->digests == NULL)
+        return;
+
+    struct stat imageInfo, dstInfo;
+    FILE *in = fopen(index->path, "r");
+    if(in == NULL || stat(options->imagePath, &imageInfo) != 0)
+    {
+        if(in != NULL)
+            fclose(in);
+        return;
+    }
+    int haveDst = dstpath != NULL && stat(dstpath, &dstInfo) == 0;
+
+    char *line = NULL;
+    size_t size = 0;
+    char stampName[4096] = "";
+    int current = 0;
+    int known = 0;
+
+    /* References follow the stamp of the image they belong to */
+    while(getline(&line, &size, in) != -1)
+    {
+        unsigned long long dev, ino, bytes;
+        long long mtime;
+        int part, sub, start = 0;
+        char digest[SHA256_HEX_SIZE];
+        uint32_t length, refNumber, zone;
+        char *name;
+
+        if(sscanf(line, "# image %llu %llu %llu %lld %d %d %n", &dev, &ino,
+                  &bytes, &mtime, &part, &sub, &start) == 6 && start != 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(stampName, sizeof(stampName), "%s", line + start);
+            current = dev == (unsigned long long)imageInfo.st_dev &&
+                      ino == (unsigned long long)imageInfo.st_ino &&
+                      bytes == (unsigned long long)imageInfo.st_size &&
+                      mtime == (long long)imageInfo.st_mtime &&
+                      part == options->usePartition &&
+                      sub == options->useSubpart;
+        }
+        else if(line[0] != '#' && current &&
+                parseReference(line, digest, &length, &name, &refNumber,
+                               &zone) &&
+                strcmp(name, stampName) == 0 && refNumber == number &&
+                zone < (uint32_t)zoneCount)
+        {
+            strcpy(index->digests[zone], digest);
+            known++;
+        }
+    }
+
+    /* Only earlier outputs holding one of those zones are of interest */
+    char (*wanted)[SHA256_HEX_SIZE] = NULL;
+    if(known > 0)
+        wanted = malloc(zoneCount * sizeof(*wanted));
+    int wantedCount = 0;
+    int i;
+    for(i = 0; wanted != NULL && i < zoneCount; i++)
+    {
+        if(index->digests[i][0] != '\0')
+            strcpy(wanted[wantedCount++], index->digests[i]);
+    }
+    if(wanted != NULL)
+        qsort(wanted, wantedCount, sizeof(*wanted), compareDigests);
+
+    int capacity = 0;
+    rewind(in);
+    while(wanted != NULL && getline(&line, &size, in) != -1)
+    {
+        zoneSource source;
+        unsigned long long offset, bytes;
+        long long mtime;
+        int start = 0;
+
+        if(sscanf(line, "# output %64s %u %llu %llu %lld %n", source.digest,
+                  &source.length, &offset, &bytes, &mtime, &start) != 5 ||
+           start == 0 ||
+           bsearch(source.digest, wanted, wantedCount, sizeof(*wanted),
+                   compareDigests) == NULL)
+            continue;
+
+        /* The output must be unchanged since it was recorded, and must not
+           be the file about to be overwritten */
+        struct stat info;
+        line[strcspn(line, "\n")] = '\0';
+        if(stat(line + start, &info) != 0 ||
+           (unsigned long long)info.st_size != bytes ||
+           (long long)info.st_mtime != mtime ||
+           offset + source.length > bytes ||
+           (haveDst && info.st_dev == dstInfo.st_dev &&
+            info.st_ino == dstInfo.st_ino))
+            continue;
+
+        if(index->sourceCount == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            zoneSource *bigger =
+                realloc(index->sources, capacity * sizeof(zoneSource));
+            if(bigger == NULL)
+                break;
+            index->sources = bigger;
+        }
+
+        source.offset = offset;
+        source.path = strdup(line + start);
+        if(source.path == NULL)
+            break;
+        index->sources[index->sourceCount++] = source;
+    }
+
+    qsort(index->sources, index->sourceCount, sizeof(zoneSource),
+          compareSources);
+
+    free(wanted);
+    free(line);
+    fclose(in);
+}
+
+/* Frees what loadZoneIndex() read */
+void freeZoneIndex(zoneIndex *index)
+{
+    int i;
+    for(i = 0; i < index->sourceCount; i++)
+        free(index->sources[i].path);
+    free(index->sources);
+    free(index->digests);
+    if(index->openSource != NULL)
+        fclose(index->openSource);
+}
+
+/* Reads a zone out of an earlier extraction; returns 0 if it could not */
+int readSource(zoneIndex *index, zoneSource *source, unsigned char *buffer)
+{
+    /* Consecutive zones usually come from the same file */
+    if(index->openSource == NULL ||
+       strcmp(index->openPath, source->path) != 0)
+    {
+        if(index->openSource != NULL)
+            fclose(index->openSource);
+        index->openPath = source->path;
+        index->openSource = fopen(source->path, "rb");
+        if(index->openSource == NULL)
+            return 0;
+    }
+
+    return readData(source->offset, source->length, index->openSource, 0,
+                    buffer) == MIN_OK;
+}
+
+/* Like streamFileContents(), but zones that an earlier extraction already
+   holds are copied from it instead of being read from the image */
+int streamWithIndex(inode *file, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, zoneIndex *index,
+                    zoneHandler handler, void *arg)
+{
+    minArena arena;
+    arenaInit(&arena, sb);
+    uint32_t zonesize = arena.zonesize;
+
+    unsigned char *copied = malloc(zonesize);
+    unsigned char *holeData = calloc(1, zonesize);
+    if(copied == NULL || holeData == NULL)
+    {
+        free(copied);
+        free(holeData);
+        arenaFree(&arena);
+        return MIN_ERR_NOMEM;
+    }
+
+    int status = MIN_OK;
+
+    int i;
+    for(i = 0; i < index->zoneCount && status == MIN_OK; i++)
+    {
+        uint32_t length = zonesize;
+        if(i == index->zoneCount - 1 && file->size % zonesize != 0)
+            length = file->size % zonesize;
+
+        zoneSource *source = NULL;
+        if(index->digests[i][0] != '\0')
+            source = bsearch(index->digests[i], index->sources,
+                             index->sourceCount, sizeof(zoneSource),
+                             compareSources);
+
+        if(source != NULL && source->length == length &&
+           readSource(index, source, copied))
+        {
+            index->reusedBytes += length;
+            status = handler(copied, length, arg);
+            continue;
+        }
+
+        arenaReset(&arena);
+        char *zoneData;
+        status = getZoneInArena(i, file, image, sb, partitionStart, verbose,
+                                &arena, &zoneData);
+        if(status == MIN_OK)
+            status = handler(zoneData != NULL ? (unsigned char *)zoneData
+                                              : holeData,
+                             length, arg);
+    }
+
+    free(copied);
+    free(holeData);
+    arenaFree(&arena);
+
+    return status;
+}
+
+/* Appends where each indexed zone of a finished extraction now lives, so
+   extractions from sibling images can copy it from there */
+void recordOutputs(zoneIndex *index, char *dstpath, uint32_t zonesize,
+                   inode *file)
+{
+    char *path = realpath(dstpath, NULL);
+    struct stat info;
+    if(path == NULL || stat(path, &info) != 0)
+    {
+        free(path);
+        return;
+    }
+
+    FILE *out = fopen(index->path, "a");
+    if(out == NULL)
+    {
+        fprintf(stderr, "WARNING: could not update zone index!\n");
+        free(path);
+        return;
+    }
+
+    int i;
+    for(i = 0; i < index->zoneCount; i++)
+    {
+        if(index->digests[i][0] == '\0')
+            continue;
+
+        uint32_t length = zonesize;
+        if(i == index->zoneCount - 1 && file->size % zonesize != 0)
+            length = file->size % zonesize;
+
+        fprintf(out, "# output %s %u %llu %llu %lld %s\n", index->digests[i],
+                length, (unsigned long long)i * zonesize,
+                (unsigned long long)info.st_size, (long long)info.st_mtime,
+                path);
+    }
+
+    if(fclose(out) != 0)
+        fprintf(stderr, "WARNING: could not update zone index!\n");
+    free(path);
+}
+
+/* Opens a file next to dstpath (or an anonymous one for stdout) to hold
+   the output until the manifest says whether to keep it */
+int openTempOutput(extractState *state, char *dstpath)
+{
+    if(dstpath == NULL)
+    {
+        state->out = tmpfile();
+        return state->out != NULL;
+    }
+
+    state->tempPath = malloc(strlen(dstpath) + 8);
+    if(state->tempPath == NULL)
+        return 0;
+    sprintf(state->tempPath, "%s.XXXXXX", dstpath);
+
+    int fd = mkstemp(state->tempPath);
+    if(fd < 0)
+    {
+        free(state->tempPath);
+        state->tempPath = NULL;
+        return 0;
+    }
+
+    /* Give it the permissions fopen() would have */
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    state->out = fdopen(fd, "wb");
+    if(state->out == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Moves the held output to its destination: renames the file next to
+   dstpath over it, or copies the anonymous one to stdout */
+int keepTempOutput(extractState *state, char *dstpath)
+{
+    if(dstpath == NULL)
+    {
+        char chunk[65536];
+        size_t got;
+
+        rewind(state->out);
+        while((got = fread(chunk, 1, sizeof(chunk), state->out)) > 0)
+        {
+            if(fwrite(chunk, 1, got, stdout) != got)
+            {
+                fprintf(stderr, "ERROR: could not write all data to stdout!\n");
+                return -1;
+            }
+        }
+        if(ferror(state->out))
+        {
+            fprintf(stderr, "ERROR: could not read back extracted data!\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    FILE *out = state->out;
+    state->out = NULL;
+    if(fclose(out) != 0)
+    {
+        fprintf(stderr, "ERROR: could not write all data to file!\n");
+        return -1;
+    }
+
+    if(rename(state->tempPath, dstpath) != 0)
+    {
+        fprintf(stderr, "ERROR: could not create/open output file!\n");
+        return -1;
+    }
+
+    free(state->tempPath);
+    state->tempPath = NULL;
+
+    return 0;
+}
+
+/* Streams a file's contents to its destination, hashing them and
+   consulting the manifest as requested */
+int extractContents(extractState *state, inode *file, FILE *image,
+                    superblock *sb, uint64_t partitionStart, char *dstpath,
+                    char *label, getOptions *options)
+{
+    /* With a manifest the write depends on the digest, so the output is held
+       in a temporary file; otherwise it goes straight to its destination */
+    if(options->manifestPath != NULL)
+    {
+        if(!openTempOutput(state, dstpath))
+        {
+            fprintf(stderr, "ERROR: could not create temporary file!\n");
+            return -1;
+        }
+    }
+    /* Output path specified; write results to file */
+    else if(dstpath != NULL)
+    {
+        state->out = fopen(dstpath, "wb");
+        if(state->out == NULL)
+        {
+            fprintf(stderr, "ERROR: could not create/open output file!\n");
+            return -1;
+        }
+    }
+
+    /* Big files are hashed on a worker while the next zones are read */
+    hashWorker worker;
+    if(state->hash != NULL && file->size >= HASH_THREAD_MIN &&
+       startHashWorker(&worker, state->hash,
+                       (uint32_t)sb->blocksize << sb->log_zone_size))
+        state->worker = &worker;
+
+    int status;
+    if(state->zones != NULL)
+        status = streamWithIndex(file, image, sb, partitionStart,
+                                 options->verbose, state->zones, extractZone,
+                                 state);
+    else
+        status = streamFileContents(file, image, sb, partitionStart,
+                                    options->verbose, extractZone, state);
+
+    if(state->worker != NULL)
+    {
+        stopHashWorker(state->worker);
+        state->worker = NULL;
+    }
+
+    if(status != MIN_OK && status != MIN_ERR_WRITE)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+    else if(status == MIN_ERR_WRITE)
+    {
+        if(dstpath == NULL)
+            fprintf(stderr, "ERROR: could not write all data to stdout!\n");
+        else
+            fprintf(stderr, "ERROR: could not write all data to file!\n");
+        return -1;
+    }
+
+    int skipWrite = 0;
+
+    if(options->printHash)
+    {
+        char shaHex[SHA256_HEX_SIZE];
+        char xxhHex[XXH64_HEX_SIZE];
+        contentHashFinal(state->hash, shaHex, xxhHex);
+
+        fprintf(stderr, "%s  %s  %s\n", shaHex, xxhHex, label);
+
+        if(options->manifestPath != NULL)
+        {
+            manifest list;
+            loadManifest(options->manifestPath, &list);
+            skipWrite = inManifest(&list, shaHex);
+            free(list.digests);
+
+            /* Record new content so later extractions can skip it */
+            if(!skipWrite)
+            {
+                FILE *manifestFile = fopen(options->manifestPath, "a");
+                if(manifestFile == NULL)
+                {
+                    fprintf(stderr, "ERROR: could not open manifest!\n");
+                    return -1;
+                }
+                fprintf(manifestFile, "%s  %s  %s\n", shaHex, xxhHex, label);
+                fclose(manifestFile);
+            }
+            else if(options->verbose == 1)
+            {
+                printf("content already in manifest, skipping write\n");
+            }
+        }
+    }
+
+    /* Known content is dropped along with the temporary file */
+    if(options->manifestPath != NULL)
+    {
+        if(skipWrite)
+            return 0;
+        if(keepTempOutput(state, dstpath) != 0)
+            return -1;
+    }
+
+    state->written = dstpath != NULL;
+    return 0;
+}
+
+/* Extracts one file from an open filesystem to dstpath (or stdout) */
+int extractFile(FILE *image, superblock *sb, uint64_t partitionStart,
+                char *srcpath, char *dstpath, char *label,
+                getOptions *options)
+{
+    int verbose = options->verbose;
+
+    int zonesize = sb->blocksize << sb->log_zone_size;
+
+    if(verbose == 1)
+        printf("zone size: %d\n", zonesize);
+
+    inode *file;
+    uint32_t number;
+    int status = findFileNumber(srcpath, image, sb, partitionStart, verbose,
+                                &number, &file);
+
+    if(status == MIN_ERR_NOT_FOUND)
+    {
+        fprintf(stderr, "ERROR: file not found\n");
+        return -1;
+    }
+    else if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+    else if(!isRegularFile(file))
+    {
+        fprintf(stderr, "ERROR: not a regular file!\n");
+        free(file);
+        return -1;
+    }
+
+    if(verbose == 1)
+    {
+        printf("\tfile's zone[0]: %d (first datazone: %d)\n", file->zone[0],
+               sb->firstdata);
+        printf("\tfile size: %d \n", file->size);
+    }
+
+    contentHash hash;
+    contentHashInit(&hash);
+
+    extractState state;
+    state.out = stdout;
+    state.tempPath = NULL;
+    state.offset = 0;
+    state.hash = options->printHash ? &hash : NULL;
+    state.worker = NULL;
+    state.zones = NULL;
+    state.written = 0;
+
+    zoneIndex zones;
+    if(options->indexPath != NULL)
+    {
+        loadZoneIndex(&zones, options, number, zonesize, file, dstpath);
+        state.zones = &zones;
+    }
+
+    int result = extractContents(&state, file, image, sb, partitionStart,
+                                 dstpath, label, options);
+
+    if(state.out != stdout && state.out != NULL)
+    {
+        status = fclose(state.out);
+        if(status != 0)
+            fprintf(stderr, "WARNING: could not close output file!\n");
+    }
+
+    /* Record the finished output so later extractions can reuse it */
+    if(state.zones != NULL)
+    {
+        if(result == 0 && state.written)
+            recordOutputs(&zones, dstpath, zonesize, file);
+        if(verbose == 1)
+            printf("reused %llu bytes from earlier extractions\n",
+                   (unsigned long long)zones.reusedBytes);
+        freeZoneIndex(&zones);
+    }
+
+    /* Still set if the output was not wanted or extraction failed */
+    if(state.tempPath != NULL)
+    {
+        unlink(state.tempPath);
+        free(state.tempPath);
+    }
+
+    free(file);
+
+    return result;
+}
+
+/* Extracts the file from one discovered filesystem to dstpath.pNsM */
+int extractFromFilesystem(FILE *image, fsLocation *location, void *arg)
+{
+    getOptions *options = (getOptions *)arg;
+
+    char *dstpath = malloc(strlen(options->dstpath) + 16);
+    if(dstpath == NULL)
+        return -1;
+
+    if(location->partition == -1)
+        strcpy(dstpath, options->dstpath);
+    else if(location->subpartition == -1)
+        sprintf(dstpath, "%s.p%d", options->dstpath, location->partition);
+    else
+        sprintf(dstpath, "%s.p%ds%d", options->dstpath, location->partition,
+                location->subpartition);
+
+    int result = extractFile(image, &location->sb, location->start,
+                             options->srcpath, dstpath, dstpath, options);
+
+    free(dstpath);
+    return result;
+}
+
 /* Prints program usage information */
 void printUsage()
 {
     fprintf(
         stderr,
-        "usage: minget [ -v ] [ -p num [ -s num ] ]"
-        " imagefile srcpath [ dstpath ]\n"
+        "usage: minget [ -v ] [ -a | -p num [ -s num ] ]"
+        " [ -H ] [ -m manifest ]\n"
+        "              [ -z index ] imagefile srcpath [ dstpath ]\n"
         "Options:\n"
+        "-a all     --- extract from every MINIX filesystem in the image to\n"
+        "               dstpath.pN or dstpath.pNsM (dstpath required)\n"
         "-p part    --- select partition for filesystem (default: none)\n"
         "-s sub     --- select subpartition for filesystem (default: none)\n"
+        "-H hash    --- print SHA-256 and XXH64 digests to stderr\n"
+        "-m file    --- skip write-out if the digest is listed in the\n"
+        "               manifest, otherwise append it (implies -H)\n"
+        "-z index   --- copy zones that a mindedup -o index says an earlier\n"
+        "               extraction holds, then record this one there\n"
         "-h help    --- print usage information and exit\n"
         "-v verbose --- increase verbosity level\n");
 }
@@ -33,10 +900,14 @@ int main(int argc, char **argv)
     int verbose = 0;
     int usePartition = -1;
     int useSubpart = -1;
+    int printHash = 0;
+    char *manifestPath = NULL;
+    char *indexPath = NULL;
+    int allFilesystems = 0;
 
     /* Loop through argument flags */
     int c;
-    while((c = getopt(argc, argv, "hvp:s:")) != -1)
+    while((c = getopt(argc, argv, "hvaHp:s:m:z:")) != -1)
     {
         switch(c)
         {
@@ -73,9 +944,34 @@ int main(int argc, char **argv)
         case 'v':
             verbose = 1;
             break;
+        /* Print content digests */
+        case 'H':
+            printHash = 1;
+            break;
+        /* Deduplicate against a manifest of digests */
+        case 'm':
+            manifestPath = optarg;
+            printHash = 1;
+            break;
+        /* Reuse zones through a mindedup index */
+        case 'z':
+            indexPath = optarg;
+            break;
+        /* Extract from all filesystems */
+        case 'a':
+            allFilesystems = 1;
+            break;
         }
     }
 
+    if(allFilesystems &&
+       (usePartition != -1 || manifestPath != NULL || indexPath != NULL))
+    {
+        fprintf(stderr,
+                "ERROR: -a cannot be combined with -p, -s, -m or -z.\n");
+        return -1;
+    }
+
     /* Get image filename */
     if(optind < argc)
     {
@@ -124,7 +1020,7 @@ int main(int argc, char **argv)
     }
 
     /* Open image file */
-    FILE *image = fopen(filename, "rb");
+    FILE *image = openImage(filename);
     if(image == NULL)
     {
         if(verbose == 1)
@@ -132,100 +1028,63 @@ int main(int argc, char **argv)
         return -1;
     }
 
-    int partitionStart = 0;
+    getOptions options;
+    options.verbose = verbose;
+    options.printHash = printHash;
+    options.manifestPath = manifestPath;
+    options.indexPath = indexPath;
+    options.imagePath = filename;
+    options.usePartition = usePartition;
+    options.useSubpart = useSubpart;
+    options.srcpath = srcpath;
+    options.dstpath = dstpath;
 
-    /* If a partition was specified */
-    if(usePartition != -1)
+    /* Extract from every filesystem found in the image at once */
+    if(allFilesystems)
     {
-        /* Switch to specified partition */
-        partitionStart = enterPartition(image, partitionStart, usePartition);
-
-        /* If subpartition was specified */
-        if(useSubpart != -1)
+        if(dstpath == NULL)
         {
-            /* Switch to subpartition */
-            partitionStart = enterPartition(image, partitionStart, useSubpart);
+            fprintf(stderr, "ERROR: -a requires a dstpath.\n");
+            return -1;
         }
-    }
-
-    /* Get superblock */
-    superblock *sb =
-        (superblock *)getData(1024, sizeof(superblock), image, partitionStart);
 
-    /* Check magic number to ensure that this is a MINIX filesystem */
-    if(sb->magic != 0x4D5A)
-    {
-        fprintf(stderr, "Bad magic number. (0x%04X)\n", sb->magic);
-        fprintf(stderr, "This doesn't look like a MINIX filesystem.\n");
-        return -1;
-    }
-
-    int zonesize = sb->blocksize << sb->log_zone_size;
+        fsLocation *found;
+        int count;
+        int status = findFilesystems(image, &found, &count);
+        if(status != MIN_OK)
+        {
+            fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+            return -1;
+        }
 
-    if(verbose == 1)
-        printf("zone size: %d\n", zonesize);
+        /* Threads would interleave verbose tracing */
+        options.verbose = 0;
 
-    inode *file = findFile(srcpath, image, sb, partitionStart, verbose);
+        int failures = forEachFilesystem(filename, found, count,
+                                         extractFromFilesystem, &options);
 
-    if(file == NULL)
-    {
-        fprintf(stderr, "ERROR: file not found\n");
-        return -1;
-    }
-    else if(!isRegularFile(file))
-    {
-        fprintf(stderr, "ERROR: not a regular file!\n");
-        return -1;
-    }
+        free(found);
+        fclose(image);
 
-    if(verbose == 1)
-    {
-        printf("\tfile's zone[0]: %d (first datazone: %d)\n", file->zone[0],
-               sb->firstdata);
-        printf("\tfile size: %d \n", file->size);
+        return failures ? -1 : 0;
     }
 
-    char *fileData = getFileContents(file, image, sb, partitionStart, verbose);
-    if(fileData == NULL)
+    /* Enter the selected partition and read its superblock */
+    uint64_t partitionStart;
+    superblock *sb;
+    int status =
+        openFilesystem(image, usePartition, useSubpart, &partitionStart, &sb);
+    if(status != MIN_OK)
     {
-        fprintf(stderr, "ERROR: fileData not found!\n");
+        printOpenError(status, sb);
         return -1;
     }
 
-    /* No output path specified; print to stdout */
-    if(dstpath == NULL)
-    {
-        int bytesWritten = fwrite(fileData, 1, file->size, stdout);
-        if(bytesWritten != file->size)
-        {
-            fprintf(stderr, "ERROR: could not write all data to stdout!\n");
-            return -1;
-        }
-    }
-    /* Output path specified; write results to file */
-    else
-    {
-        FILE *outfile = fopen(dstpath, "wb");
-        if(outfile == NULL)
-        {
-            fprintf(stderr, "ERROR: could not create/open output file!\n");
-            return -1;
-        }
-
-        int bytesWritten = fwrite(fileData, 1, file->size, outfile);
-        if(bytesWritten != file->size)
-        {
-            fprintf(stderr, "ERROR: could not write all data to file!\n");
-            return -1;
-        }
-
-        int status = fclose(outfile);
-        if(status != 0)
-            fprintf(stderr, "WARNING: could not close output file!\n");
-    }
+    int result = extractFile(image, sb, partitionStart, srcpath, dstpath,
+                             srcpath, &options);
 
     free(sb);
-    free(file);
-    free(fileData);
     fclose(image);
+
+    return result;
 }
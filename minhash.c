@@ -0,0 +1,350 @@
+#include "minhash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* SHA-256 round constants */
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/* Compresses one 64 byte block into the SHA-256 state */
+static void sha256Block(uint32_t state[8], const uint8_t *block)
+{
+    uint32_t w[64];
+
+    int i;
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) |
+               ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for(i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(i = 0; i < 64; i++)
+    {
+        uint32_t S1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + sha256K[i] + w[i];
+        uint32_t S0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/* Initializes a SHA-256 context */
+void sha256Init(sha256ctx *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->length = 0;
+    ctx->bufferLength = 0;
+}
+
+/* Adds bytes to a SHA-256 digest */
+void sha256Update(sha256ctx *ctx, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    ctx->length += length;
+
+    /* Top up a partially filled block first */
+    if(ctx->bufferLength > 0)
+    {
+        size_t fill = 64 - ctx->bufferLength;
+        if(fill > length)
+            fill = length;
+
+        memcpy(ctx->buffer + ctx->bufferLength, bytes, fill);
+        ctx->bufferLength += fill;
+        bytes += fill;
+        length -= fill;
+
+        if(ctx->bufferLength < 64)
+            return;
+
+        sha256Block(ctx->state, ctx->buffer);
+        ctx->bufferLength = 0;
+    }
+
+    /* Compress whole blocks straight from the input */
+    while(length >= 64)
+    {
+        sha256Block(ctx->state, bytes);
+        bytes += 64;
+        length -= 64;
+    }
+
+    /* Save the remainder for next time */
+    memcpy(ctx->buffer, bytes, length);
+    ctx->bufferLength = length;
+}
+
+/* Finishes a SHA-256 digest and writes it to out */
+void sha256Final(sha256ctx *ctx, uint8_t out[SHA256_DIGEST_SIZE])
+{
+    uint64_t bitLength = ctx->length * 8;
+
+    /* Append the terminating bit and pad up to the length field */
+    ctx->buffer[ctx->bufferLength++] = 0x80;
+    if(ctx->bufferLength > 56)
+    {
+        memset(ctx->buffer + ctx->bufferLength, 0, 64 - ctx->bufferLength);
+        sha256Block(ctx->state, ctx->buffer);
+        ctx->bufferLength = 0;
+    }
+    memset(ctx->buffer + ctx->bufferLength, 0, 56 - ctx->bufferLength);
+
+    int i;
+    for(i = 0; i < 8; i++)
+        ctx->buffer[56 + i] = (uint8_t)(bitLength >> (56 - i * 8));
+
+    sha256Block(ctx->state, ctx->buffer);
+
+    for(i = 0; i < 8; i++)
+    {
+        out[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+/* XXH64 primes */
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+/* Reads a little endian 64 bit value */
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* Reads a little endian 32 bit value */
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* Mixes one 8 byte lane into an accumulator */
+static uint64_t xxh64Round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+/* Folds an accumulator into the converged hash */
+static uint64_t xxh64Merge(uint64_t hash, uint64_t acc)
+{
+    hash ^= xxh64Round(0, acc);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/* Initializes an XXH64 context with the given seed */
+void xxh64Init(xxh64ctx *ctx, uint64_t seed)
+{
+    ctx->acc[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    ctx->acc[1] = seed + XXH_PRIME2;
+    ctx->acc[2] = seed;
+    ctx->acc[3] = seed - XXH_PRIME1;
+    ctx->length = 0;
+    ctx->bufferLength = 0;
+}
+
+/* Adds bytes to an XXH64 digest */
+void xxh64Update(xxh64ctx *ctx, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    ctx->length += length;
+
+    /* Top up a partially filled stripe first */
+    if(ctx->bufferLength > 0)
+    {
+        size_t fill = 32 - ctx->bufferLength;
+        if(fill > length)
+            fill = length;
+
+        memcpy(ctx->buffer + ctx->bufferLength, bytes, fill);
+        ctx->bufferLength += fill;
+        bytes += fill;
+        length -= fill;
+
+        if(ctx->bufferLength < 32)
+            return;
+
+        ctx->acc[0] = xxh64Round(ctx->acc[0], read64(ctx->buffer));
+        ctx->acc[1] = xxh64Round(ctx->acc[1], read64(ctx->buffer + 8));
+        ctx->acc[2] = xxh64Round(ctx->acc[2], read64(ctx->buffer + 16));
+        ctx->acc[3] = xxh64Round(ctx->acc[3], read64(ctx->buffer + 24));
+        ctx->bufferLength = 0;
+    }
+
+    /* The four lanes are independent, so the compiler can keep them all
+       in flight at once */
+    uint64_t a0 = ctx->acc[0], a1 = ctx->acc[1];
+    uint64_t a2 = ctx->acc[2], a3 = ctx->acc[3];
+    while(length >= 32)
+    {
+        a0 = xxh64Round(a0, read64(bytes));
+        a1 = xxh64Round(a1, read64(bytes + 8));
+        a2 = xxh64Round(a2, read64(bytes + 16));
+        a3 = xxh64Round(a3, read64(bytes + 24));
+        bytes += 32;
+        length -= 32;
+    }
+    ctx->acc[0] = a0;
+    ctx->acc[1] = a1;
+    ctx->acc[2] = a2;
+    ctx->acc[3] = a3;
+
+    /* Save the remainder for next time */
+    memcpy(ctx->buffer, bytes, length);
+    ctx->bufferLength = length;
+}
+
+/* Finishes an XXH64 digest */
+uint64_t xxh64Final(xxh64ctx *ctx)
+{
+    uint64_t hash;
+
+    if(ctx->length >= 32)
+    {
+        hash = ROTL64(ctx->acc[0], 1) + ROTL64(ctx->acc[1], 7) +
+               ROTL64(ctx->acc[2], 12) + ROTL64(ctx->acc[3], 18);
+        hash = xxh64Merge(hash, ctx->acc[0]);
+        hash = xxh64Merge(hash, ctx->acc[1]);
+        hash = xxh64Merge(hash, ctx->acc[2]);
+        hash = xxh64Merge(hash, ctx->acc[3]);
+    }
+    else
+    {
+        /* acc[2] still holds the seed when no stripe was processed */
+        hash = ctx->acc[2] + XXH_PRIME5;
+    }
+
+    hash += ctx->length;
+
+    /* Consume the tail of the input */
+    const uint8_t *p = ctx->buffer;
+    const uint8_t *end = ctx->buffer + ctx->bufferLength;
+
+    while(p + 8 <= end)
+    {
+        hash ^= xxh64Round(0, read64(p));
+        hash = ROTL64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if(p + 4 <= end)
+    {
+        hash ^= (uint64_t)read32(p) * XXH_PRIME1;
+        hash = ROTL64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while(p < end)
+    {
+        hash ^= (*p) * XXH_PRIME5;
+        hash = ROTL64(hash, 11) * XXH_PRIME1;
+        p++;
+    }
+
+    /* Final avalanche */
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/* Hashes a single buffer with XXH64 */
+uint64_t xxh64(const void *data, size_t length, uint64_t seed)
+{
+    xxh64ctx ctx;
+    xxh64Init(&ctx, seed);
+    xxh64Update(&ctx, data, length);
+    return xxh64Final(&ctx);
+}
+
+/* Initializes both digests of a content hash */
+void contentHashInit(contentHash *hash)
+{
+    sha256Init(&hash->sha);
+    xxh64Init(&hash->xxh, 0);
+}
+
+/* Feeds bytes to both digests of a content hash */
+void contentHashUpdate(contentHash *hash, const void *data, size_t length)
+{
+    /* Feed both digests from the same buffer while it is still in cache */
+    sha256Update(&hash->sha, data, length);
+    xxh64Update(&hash->xxh, data, length);
+}
+
+/* Finishes a content hash and formats both digests as hex strings */
+void contentHashFinal(contentHash *hash, char shaHex[SHA256_HEX_SIZE],
+                      char xxhHex[XXH64_HEX_SIZE])
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256Final(&hash->sha, digest);
+
+    int i;
+    for(i = 0; i < SHA256_DIGEST_SIZE; i++)
+        sprintf(shaHex + i * 2, "%02x", digest[i]);
+
+    sprintf(xxhHex, "%016llx", (unsigned long long)xxh64Final(&hash->xxh));
+}
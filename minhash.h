@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+/* Hex string lengths (including null terminator) */
+#define SHA256_HEX_SIZE (SHA256_DIGEST_SIZE * 2 + 1)
+#define XXH64_HEX_SIZE 17
+
+typedef struct sha256ctx
+{
+    uint32_t state[8];     /* intermediate hash value */
+    uint64_t length;       /* total bytes hashed so far */
+    uint8_t buffer[64];    /* partial block awaiting compression */
+    uint32_t bufferLength; /* number of bytes in buffer */
+} sha256ctx;
+
+typedef struct xxh64ctx
+{
+    uint64_t acc[4];       /* lane accumulators */
+    uint64_t length;       /* total bytes hashed so far */
+    uint8_t buffer[32];    /* partial stripe awaiting processing */
+    uint32_t bufferLength; /* number of bytes in buffer */
+} xxh64ctx;
+
+/* Both digests of a stream, computed together in a single pass */
+typedef struct contentHash
+{
+    sha256ctx sha;
+    xxh64ctx xxh;
+} contentHash;
+
+/* Initializes a SHA-256 context */
+void sha256Init(sha256ctx *ctx);
+
+/* Adds bytes to a SHA-256 digest */
+void sha256Update(sha256ctx *ctx, const void *data, size_t length);
+
+/* Finishes a SHA-256 digest and writes it to out */
+void sha256Final(sha256ctx *ctx, uint8_t out[SHA256_DIGEST_SIZE]);
+
+/* Initializes an XXH64 context with the given seed */
+void xxh64Init(xxh64ctx *ctx, uint64_t seed);
+
+/* Adds bytes to an XXH64 digest */
+void xxh64Update(xxh64ctx *ctx, const void *data, size_t length);
+
+/* Finishes an XXH64 digest */
+uint64_t xxh64Final(xxh64ctx *ctx);
+
+/* Hashes a single buffer with XXH64 */
+uint64_t xxh64(const void *data, size_t length, uint64_t seed);
+
+/* Initializes both digests of a content hash */
+void contentHashInit(contentHash *hash);
+
+/* Feeds bytes to both digests of a content hash */
+void contentHashUpdate(contentHash *hash, const void *data, size_t length);
+
+/* Finishes a content hash and formats both digests as hex strings */
+void contentHashFinal(contentHash *hash, char shaHex[SHA256_HEX_SIZE],
+                      char xxhHex[XXH64_HEX_SIZE]);
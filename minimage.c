@@ -0,0 +1,860 @@
+#define _GNU_SOURCE
+#include "minimage.h"
+#include "minutil.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef MIN_ZSTD
+#include <zstd.h>
+#endif
+
+#define FORMAT_GZIP 1
+#define FORMAT_ZSTD 2
+
+/* Magic numbers of the zstd seekable format */
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER 9
+
+/* Largest frame that will be decompressed into memory */
+#define MAX_FRAME_SIZE (256 * 1024 * 1024)
+
+/* Compressed bytes read at a time while inflating */
+#define READ_CHUNK 16384
+
+/* Start of a prebuilt gzip index file */
+#define INDEX_MAGIC "MINGZIX2"
+
+/* Most that deflate can expand its input, used to vet index sizes */
+#define MAX_DEFLATE_RATIO 1032
+
+/* A point where decompression can start without earlier data */
+typedef struct imageFrame
+{
+    uint64_t in;           /* compressed offset */
+    uint64_t out;          /* uncompressed offset */
+    uint32_t inSize;       /* zstd: compressed length of the frame */
+    int bits;              /* gzip: bits of the byte before in to use */
+    unsigned char *window; /* gzip: the output just before the frame */
+} imageFrame;
+
+/* The frames of a compressed image, shared by every stream open on it */
+typedef struct frameIndex
+{
+    char *filename;
+    int format;
+    imageFrame *frames;
+    int count;
+    uint64_t size;           /* uncompressed bytes */
+    uint64_t compressedSize; /* used to spot a stale prebuilt index */
+    int64_t mtime;           /* likewise */
+    int users;
+    struct frameIndex *next;
+} frameIndex;
+
+/* One decompressed frame held by an open image */
+typedef struct cachedFrame
+{
+    int frame;     /* frame number, or -1 if empty */
+    uint64_t used; /* clock value at last use */
+    unsigned char *data;
+} cachedFrame;
+
+/* State behind a stream returned by openImage */
+typedef struct compressedImage
+{
+    FILE *file; /* the compressed file itself */
+    frameIndex *index;
+    uint64_t position;
+    uint64_t clock;
+    cachedFrame cache[FRAME_CACHE_SLOTS];
+} compressedImage;
+
+/* Indexes in use, so threads opening the same image build it only once */
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+static frameIndex *openIndexes = NULL;
+
+/* Decodes a little endian 32 bit value */
+static uint32_t readLE32(const unsigned char *bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+           ((uint32_t)bytes[3] << 24);
+}
+
+/* Reads up to size bytes at an offset; got is short only at end of file */
+static int readAt(int fd, void *buffer, size_t size, uint64_t offset,
+                  size_t *got)
+{
+    *got = 0;
+    while(*got < size)
+    {
+        ssize_t count = pread(fd, (char *)buffer + *got, size - *got,
+                              (off_t)(offset + *got));
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count < 0)
+            return MIN_ERR_READ;
+        if(count == 0)
+            break;
+        *got += count;
+    }
+
+    return MIN_OK;
+}
+
+/* Frees an index and its windows */
+static void freeIndex(frameIndex *index)
+{
+    int i;
+    for(i = 0; i < index->count; i++)
+        free(index->frames[i].window);
+    free(index->frames);
+    free(index->filename);
+    free(index);
+}
+
+/* Appends a frame to an index */
+static int addFrame(frameIndex *index, int *capacity, imageFrame *frame)
+{
+    if(index->count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        imageFrame *bigger = (imageFrame *)realloc(
+            index->frames, *capacity * sizeof(imageFrame));
+        if(bigger == NULL)
+            return MIN_ERR_NOMEM;
+        index->frames = bigger;
+    }
+
+    index->frames[index->count++] = *frame;
+    return MIN_OK;
+}
+
+/* Gets the uncompressed length of a frame */
+static uint64_t frameLength(frameIndex *index, int frame)
+{
+    uint64_t end = frame + 1 < index->count ? index->frames[frame + 1].out
+                                            : index->size;
+    return end - index->frames[frame].out;
+}
+
+/* Decompresses a whole single member gzip file once, recording an access
+   point at a deflate block boundary about every GZIP_SPAN bytes */
+static int buildGzipIndex(int fd, frameIndex *index)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if(inflateInit2(&strm, 47) != Z_OK)
+        return MIN_ERR_NOMEM;
+
+    unsigned char *input = malloc(READ_CHUNK);
+    unsigned char *window = calloc(1, GZIP_WINDOW);
+    if(input == NULL || window == NULL)
+    {
+        free(input);
+        free(window);
+        inflateEnd(&strm);
+        return MIN_ERR_NOMEM;
+    }
+
+    uint64_t totalIn = 0;
+    uint64_t totalOut = 0;
+    uint64_t last = 0;
+    uint64_t readOffset = 0;
+    int capacity = 0;
+    int status = MIN_OK;
+    int ret = Z_OK;
+
+    strm.avail_out = 0;
+    while(ret != Z_STREAM_END && status == MIN_OK)
+    {
+        size_t got;
+        status = readAt(fd, input, READ_CHUNK, readOffset, &got);
+        if(status == MIN_OK && got == 0)
+            status = MIN_ERR_READ;
+        if(status != MIN_OK)
+            break;
+        readOffset += got;
+        strm.next_in = input;
+        strm.avail_in = got;
+
+        while(strm.avail_in != 0)
+        {
+            /* Output cycles through the window, which is all that is kept */
+            if(strm.avail_out == 0)
+            {
+                strm.next_out = window;
+                strm.avail_out = GZIP_WINDOW;
+            }
+
+            totalIn += strm.avail_in;
+            totalOut += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totalIn -= strm.avail_in;
+            totalOut -= strm.avail_out;
+
+            if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            {
+                status = MIN_ERR_READ;
+                break;
+            }
+            if(ret == Z_STREAM_END)
+                break;
+
+            /* At a block boundary: note where it starts and its history */
+            if((strm.data_type & 128) && !(strm.data_type & 64) &&
+               (totalOut == 0 || totalOut - last > GZIP_SPAN))
+            {
+                imageFrame frame;
+                frame.in = totalIn;
+                frame.out = totalOut;
+                frame.inSize = 0;
+                frame.bits = strm.data_type & 7;
+                frame.window = malloc(GZIP_WINDOW);
+                if(frame.window == NULL)
+                {
+                    status = MIN_ERR_NOMEM;
+                    break;
+                }
+
+                unsigned left = strm.avail_out;
+                if(left)
+                    memcpy(frame.window, window + GZIP_WINDOW - left, left);
+                if(left < GZIP_WINDOW)
+                    memcpy(frame.window + left, window, GZIP_WINDOW - left);
+
+                status = addFrame(index, &capacity, &frame);
+                if(status != MIN_OK)
+                {
+                    free(frame.window);
+                    break;
+                }
+                last = totalOut;
+            }
+        }
+    }
+
+    index->size = totalOut;
+
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+
+    return status;
+}
+
+/* Loads a prebuilt gzip index, if there is one and it matches the file;
+   anything stale or inconsistent is MIN_ERR_READ so it gets rebuilt */
+static int loadGzipIndex(const char *path, frameIndex *index)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+        return MIN_ERR_NOT_FOUND;
+
+    char magic[8];
+    uint64_t compressedSize;
+    int64_t mtime;
+    uint32_t count;
+    int status = MIN_OK;
+
+    if(fread(magic, 1, 8, file) != 8 || memcmp(magic, INDEX_MAGIC, 8) != 0 ||
+       fread(&compressedSize, sizeof(compressedSize), 1, file) != 1 ||
+       fread(&mtime, sizeof(mtime), 1, file) != 1 ||
+       fread(&index->size, sizeof(index->size), 1, file) != 1 ||
+       fread(&count, sizeof(count), 1, file) != 1 ||
+       compressedSize != index->compressedSize || mtime != index->mtime)
+        status = MIN_ERR_READ;
+
+    /* Every index starts at the beginning of the data, and no more can come
+       out than deflate could have packed in */
+    if(status == MIN_OK &&
+       (count == 0 || count > compressedSize || index->size == 0 ||
+        index->size / MAX_DEFLATE_RATIO > compressedSize))
+        status = MIN_ERR_READ;
+
+    int capacity = 0;
+    uint32_t i;
+    for(i = 0; i < count && status == MIN_OK; i++)
+    {
+        imageFrame frame;
+        int32_t bits;
+        frame.inSize = 0;
+        frame.window = malloc(GZIP_WINDOW);
+        if(frame.window == NULL)
+        {
+            status = MIN_ERR_NOMEM;
+            break;
+        }
+
+        if(fread(&frame.in, sizeof(frame.in), 1, file) != 1 ||
+           fread(&frame.out, sizeof(frame.out), 1, file) != 1 ||
+           fread(&bits, sizeof(bits), 1, file) != 1 ||
+           fread(frame.window, 1, GZIP_WINDOW, file) != GZIP_WINDOW ||
+           bits < 0 || bits > 7 || frame.out > index->size ||
+           frame.in >= compressedSize || (bits != 0 && frame.in == 0) ||
+           (i == 0 && frame.out != 0) ||
+           (i > 0 && (frame.out <= index->frames[i - 1].out ||
+                      frame.in <= index->frames[i - 1].in)))
+        {
+            free(frame.window);
+            status = MIN_ERR_READ;
+            break;
+        }
+        frame.bits = bits;
+
+        status = addFrame(index, &capacity, &frame);
+        if(status != MIN_OK)
+            free(frame.window);
+    }
+
+    /* Spans too big to cache are as good as damaged */
+    for(i = 0; i < count && status == MIN_OK; i++)
+    {
+        if(frameLength(index, i) > MAX_FRAME_SIZE)
+            status = MIN_ERR_READ;
+    }
+
+    fclose(file);
+
+    return status;
+}
+
+/* Reads the seek table at the end of a seekable zstd file */
+static int readSeekTable(int fd, frameIndex *index)
+{
+    unsigned char footer[ZSTD_SEEKABLE_FOOTER];
+    size_t got;
+
+    if(index->compressedSize < ZSTD_SEEKABLE_FOOTER + 8)
+        return MIN_ERR_MAGIC;
+
+    int status = readAt(fd, footer, sizeof(footer),
+                        index->compressedSize - sizeof(footer), &got);
+    if(status != MIN_OK)
+        return status;
+    if(got != sizeof(footer) || readLE32(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+        return MIN_ERR_MAGIC;
+
+    uint32_t count = readLE32(footer);
+    uint32_t entrySize = (footer[4] & 0x80) ? 12 : 8;
+    uint64_t tableSize = (uint64_t)count * entrySize;
+    if(tableSize + ZSTD_SEEKABLE_FOOTER + 8 > index->compressedSize)
+        return MIN_ERR_MAGIC;
+
+    /* The table is a skippable frame holding one entry per frame */
+    uint64_t tableStart =
+        index->compressedSize - ZSTD_SEEKABLE_FOOTER - tableSize - 8;
+    unsigned char *table = malloc(tableSize + 8);
+    if(table == NULL)
+        return MIN_ERR_NOMEM;
+
+    status = readAt(fd, table, tableSize + 8, tableStart, &got);
+    if(status == MIN_OK &&
+       (got != tableSize + 8 || readLE32(table) != ZSTD_SKIPPABLE_MAGIC ||
+        readLE32(table + 4) != tableSize + ZSTD_SEEKABLE_FOOTER))
+        status = MIN_ERR_MAGIC;
+
+    uint64_t in = 0;
+    uint64_t out = 0;
+    int capacity = 0;
+    uint32_t i;
+    for(i = 0; i < count && status == MIN_OK; i++)
+    {
+        unsigned char *entry = table + 8 + i * entrySize;
+        imageFrame frame;
+        frame.in = in;
+        frame.out = out;
+        frame.inSize = readLE32(entry);
+        frame.bits = 0;
+        frame.window = NULL;
+
+        uint32_t outSize = readLE32(entry + 4);
+        if(outSize == 0 || outSize > MAX_FRAME_SIZE ||
+           in + frame.inSize > tableStart)
+        {
+            status = MIN_ERR_MAGIC;
+            break;
+        }
+
+        status = addFrame(index, &capacity, &frame);
+        in += frame.inSize;
+        out += outSize;
+    }
+    index->size = out;
+
+    free(table);
+
+    return status;
+}
+
+/* Builds or loads the frame index for a compressed file */
+static int indexImage(const char *filename, int fd, frameIndex *index)
+{
+    if(index->format == FORMAT_ZSTD)
+        return readSeekTable(fd, index);
+
+    /* Prefer the prebuilt index over a full decompression pass */
+    char *indexPath = malloc(strlen(filename) + sizeof(GZIP_INDEX_SUFFIX));
+    if(indexPath == NULL)
+        return MIN_ERR_NOMEM;
+    sprintf(indexPath, "%s%s", filename, GZIP_INDEX_SUFFIX);
+
+    int status = loadGzipIndex(indexPath, index);
+    if(status == MIN_ERR_READ)
+        fprintf(stderr, "WARNING: ignoring stale or damaged index %s\n",
+                indexPath);
+    free(indexPath);
+
+    if(status != MIN_OK)
+    {
+        int i;
+        for(i = 0; i < index->count; i++)
+            free(index->frames[i].window);
+        free(index->frames);
+        index->frames = NULL;
+        index->count = 0;
+
+        status = buildGzipIndex(fd, index);
+    }
+
+    /* Spans must fit in memory to be cached, and reads start from the
+       first one */
+    int i;
+    for(i = 0; i < index->count && status == MIN_OK; i++)
+    {
+        if(frameLength(index, i) > MAX_FRAME_SIZE)
+            status = MIN_ERR_READ;
+    }
+    if(status == MIN_OK && index->size != 0 &&
+       (index->count == 0 || index->frames[0].out != 0))
+        status = MIN_ERR_READ;
+
+    return status;
+}
+
+/* Finds the index for a file, building it if no stream has it open */
+static frameIndex *acquireIndex(const char *filename, int fd, int format)
+{
+    struct stat info;
+    if(fstat(fd, &info) != 0)
+        return NULL;
+
+    pthread_mutex_lock(&indexLock);
+
+    frameIndex *index;
+    for(index = openIndexes; index != NULL; index = index->next)
+    {
+        if(strcmp(index->filename, filename) == 0 &&
+           index->compressedSize == (uint64_t)info.st_size &&
+           index->mtime == (int64_t)info.st_mtime)
+        {
+            index->users++;
+            pthread_mutex_unlock(&indexLock);
+            return index;
+        }
+    }
+
+    /* Built under the lock so other threads wait instead of repeating it */
+    index = (frameIndex *)calloc(1, sizeof(frameIndex));
+    if(index != NULL)
+        index->filename = strdup(filename);
+    if(index == NULL || index->filename == NULL)
+    {
+        free(index);
+        pthread_mutex_unlock(&indexLock);
+        return NULL;
+    }
+    index->format = format;
+    index->compressedSize = info.st_size;
+    index->mtime = info.st_mtime;
+    index->users = 1;
+
+    if(indexImage(filename, fd, index) != MIN_OK)
+    {
+        freeIndex(index);
+        pthread_mutex_unlock(&indexLock);
+        return NULL;
+    }
+
+    index->next = openIndexes;
+    openIndexes = index;
+
+    pthread_mutex_unlock(&indexLock);
+    return index;
+}
+
+/* Drops a stream's use of an index, freeing it with the last one */
+static void releaseIndex(frameIndex *index)
+{
+    pthread_mutex_lock(&indexLock);
+
+    if(--index->users == 0)
+    {
+        frameIndex **link = &openIndexes;
+        while(*link != index)
+            link = &(*link)->next;
+        *link = index->next;
+        freeIndex(index);
+    }
+
+    pthread_mutex_unlock(&indexLock);
+}
+
+/* Inflates one gzip span, starting from its access point */
+static int inflateFrame(int fd, frameIndex *index, int number,
+                        unsigned char *out)
+{
+    imageFrame *frame = &index->frames[number];
+    uint64_t length = frameLength(index, number);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if(inflateInit2(&strm, -15) != Z_OK)
+        return MIN_ERR_NOMEM;
+
+    unsigned char input[READ_CHUNK];
+    uint64_t in = frame->in;
+    size_t got;
+    int status = MIN_OK;
+
+    /* A block may start partway through a byte */
+    if(frame->bits)
+    {
+        status = readAt(fd, input, 1, in - 1, &got);
+        if(status == MIN_OK && got != 1)
+            status = MIN_ERR_READ;
+        if(status == MIN_OK)
+            inflatePrime(&strm, frame->bits, input[0] >> (8 - frame->bits));
+    }
+    if(status == MIN_OK)
+        inflateSetDictionary(&strm, frame->window, GZIP_WINDOW);
+
+    strm.next_out = out;
+    strm.avail_out = length;
+
+    while(strm.avail_out != 0 && status == MIN_OK)
+    {
+        if(strm.avail_in == 0)
+        {
+            status = readAt(fd, input, READ_CHUNK, in, &got);
+            if(status == MIN_OK && got == 0)
+                status = MIN_ERR_READ;
+            if(status != MIN_OK)
+                break;
+            in += got;
+            strm.next_in = input;
+            strm.avail_in = got;
+        }
+
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END)
+            break;
+        if(ret != Z_OK)
+            status = MIN_ERR_READ;
+    }
+
+    if(status == MIN_OK && strm.avail_out != 0)
+        status = MIN_ERR_READ;
+
+    inflateEnd(&strm);
+
+    return status;
+}
+
+/* Decompresses one zstd frame */
+static int unpackFrame(int fd, frameIndex *index, int number,
+                       unsigned char *out)
+{
+#ifdef MIN_ZSTD
+    imageFrame *frame = &index->frames[number];
+    uint64_t length = frameLength(index, number);
+
+    unsigned char *input = malloc(frame->inSize ? frame->inSize : 1);
+    if(input == NULL)
+        return MIN_ERR_NOMEM;
+
+    size_t got;
+    int status = readAt(fd, input, frame->inSize, frame->in, &got);
+    if(status == MIN_OK && got != frame->inSize)
+        status = MIN_ERR_READ;
+
+    if(status == MIN_OK)
+    {
+        size_t result = ZSTD_decompress(out, length, input, frame->inSize);
+        if(ZSTD_isError(result) || result != length)
+            status = MIN_ERR_READ;
+    }
+
+    free(input);
+
+    return status;
+#else
+    return MIN_ERR_READ;
+#endif
+}
+
+/* Gets a decompressed frame, from the cache if it is there */
+static int loadFrame(compressedImage *image, int frame, unsigned char **data)
+{
+    /* Replace the least recently used slot (empty slots were never used) */
+    cachedFrame *slot = &image->cache[0];
+    int i;
+    for(i = 0; i < FRAME_CACHE_SLOTS; i++)
+    {
+        if(image->cache[i].frame == frame)
+        {
+            image->cache[i].used = ++image->clock;
+            *data = image->cache[i].data;
+            return MIN_OK;
+        }
+        if(image->cache[i].used < slot->used)
+            slot = &image->cache[i];
+    }
+
+    uint64_t length = frameLength(image->index, frame);
+    unsigned char *buffer = realloc(slot->data, length ? length : 1);
+    if(buffer == NULL)
+        return MIN_ERR_NOMEM;
+    slot->data = buffer;
+    slot->frame = -1;
+
+    int fd = fileno(image->file);
+    int status = image->index->format == FORMAT_GZIP
+                     ? inflateFrame(fd, image->index, frame, buffer)
+                     : unpackFrame(fd, image->index, frame, buffer);
+    if(status != MIN_OK)
+        return status;
+
+    slot->frame = frame;
+    slot->used = ++image->clock;
+    *data = buffer;
+
+    return MIN_OK;
+}
+
+/* Finds the frame holding an uncompressed offset */
+static int findFrame(frameIndex *index, uint64_t offset)
+{
+    int low = 0;
+    int high = index->count - 1;
+    while(low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if(index->frames[middle].out <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    return low;
+}
+
+/* Stream read function: copies out of decompressed frames */
+static ssize_t imageRead(void *cookie, char *buffer, size_t size)
+{
+    compressedImage *image = (compressedImage *)cookie;
+    frameIndex *index = image->index;
+    size_t done = 0;
+
+    while(done < size && image->position < index->size)
+    {
+        int frame = findFrame(index, image->position);
+        unsigned char *data;
+        if(loadFrame(image, frame, &data) != MIN_OK)
+        {
+            errno = EIO;
+            return done ? (ssize_t)done : -1;
+        }
+
+        uint64_t offset = image->position - index->frames[frame].out;
+        uint64_t available = frameLength(index, frame) - offset;
+        size_t chunk = size - done < available ? size - done : available;
+
+        memcpy(buffer + done, data + offset, chunk);
+        done += chunk;
+        image->position += chunk;
+    }
+
+    return done;
+}
+
+/* Stream seek function over the uncompressed data */
+static int imageSeek(void *cookie, off64_t *offset, int whence)
+{
+    compressedImage *image = (compressedImage *)cookie;
+    int64_t base = 0;
+
+    if(whence == SEEK_CUR)
+        base = image->position;
+    else if(whence == SEEK_END)
+        base = image->index->size;
+    else if(whence != SEEK_SET)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(*offset < -base)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    image->position = base + *offset;
+    *offset = image->position;
+    return 0;
+}
+
+/* Stream close function */
+static int imageClose(void *cookie)
+{
+    compressedImage *image = (compressedImage *)cookie;
+
+    int i;
+    for(i = 0; i < FRAME_CACHE_SLOTS; i++)
+        free(image->cache[i].data);
+
+    releaseIndex(image->index);
+    int status = fclose(image->file);
+    free(image);
+
+    return status;
+}
+
+/* Opens a filesystem image, decompressing it on demand if compressed */
+FILE *openImage(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if(file == NULL)
+        return NULL;
+
+    unsigned char magic[4];
+    size_t got = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+
+    int format = 0;
+    if(got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        format = FORMAT_GZIP;
+    else if(got == 4 && readLE32(magic) == ZSTD_FRAME_MAGIC)
+        format = FORMAT_ZSTD;
+
+    if(format == 0)
+        return file;
+
+#ifndef MIN_ZSTD
+    if(format == FORMAT_ZSTD)
+    {
+        fprintf(stderr, "WARNING: %s is zstd compressed; rebuild with "
+                        "ZSTD=1 to read it\n", filename);
+        return file;
+    }
+#endif
+
+    /* Anything that does not index is left for the magic number check */
+    frameIndex *index = acquireIndex(filename, fileno(file), format);
+    if(index == NULL)
+    {
+        fprintf(stderr, "WARNING: could not index compressed image %s\n",
+                filename);
+        return file;
+    }
+
+    compressedImage *image =
+        (compressedImage *)calloc(1, sizeof(compressedImage));
+    if(image == NULL)
+    {
+        releaseIndex(index);
+        fclose(file);
+        return NULL;
+    }
+    image->file = file;
+    image->index = index;
+
+    int i;
+    for(i = 0; i < FRAME_CACHE_SLOTS; i++)
+        image->cache[i].frame = -1;
+
+    cookie_io_functions_t functions = {imageRead, NULL, imageSeek,
+                                       imageClose};
+    FILE *stream = fopencookie(image, "rb", functions);
+    if(stream == NULL)
+    {
+        imageClose(image);
+        return NULL;
+    }
+
+    return stream;
+}
+
+/* Writes the access point index of a gzip image for later opens */
+int writeGzipIndex(const char *filename, const char *indexPath)
+{
+    FILE *file = fopen(filename, "rb");
+    if(file == NULL)
+        return MIN_ERR_NOT_FOUND;
+
+    struct stat info;
+    frameIndex index;
+    memset(&index, 0, sizeof(index));
+
+    int status = MIN_OK;
+    if(fstat(fileno(file), &info) != 0)
+        status = MIN_ERR_READ;
+    else
+    {
+        index.compressedSize = info.st_size;
+        index.mtime = info.st_mtime;
+    }
+
+    if(status == MIN_OK)
+        status = buildGzipIndex(fileno(file), &index);
+    fclose(file);
+
+    FILE *out = NULL;
+    if(status == MIN_OK)
+    {
+        out = fopen(indexPath, "wb");
+        if(out == NULL)
+            status = MIN_ERR_WRITE;
+    }
+
+    /* Fields are in host byte order; the index is a local cache */
+    if(status == MIN_OK)
+    {
+        uint32_t count = index.count;
+        if(fwrite(INDEX_MAGIC, 1, 8, out) != 8 ||
+           fwrite(&index.compressedSize, sizeof(uint64_t), 1, out) != 1 ||
+           fwrite(&index.mtime, sizeof(int64_t), 1, out) != 1 ||
+           fwrite(&index.size, sizeof(uint64_t), 1, out) != 1 ||
+           fwrite(&count, sizeof(count), 1, out) != 1)
+            status = MIN_ERR_WRITE;
+
+        int i;
+        for(i = 0; i < index.count && status == MIN_OK; i++)
+        {
+            imageFrame *frame = &index.frames[i];
+            int32_t bits = frame->bits;
+            if(fwrite(&frame->in, sizeof(uint64_t), 1, out) != 1 ||
+               fwrite(&frame->out, sizeof(uint64_t), 1, out) != 1 ||
+               fwrite(&bits, sizeof(bits), 1, out) != 1 ||
+               fwrite(frame->window, 1, GZIP_WINDOW, out) != GZIP_WINDOW)
+                status = MIN_ERR_WRITE;
+        }
+    }
+    if(out != NULL && fclose(out) != 0 && status == MIN_OK)
+        status = MIN_ERR_WRITE;
+
+    int i;
+    for(i = 0; i < index.count; i++)
+        free(index.frames[i].window);
+    free(index.frames);
+
+    return status;
+}
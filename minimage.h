@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <stdio.h>
+
+/* Uncompressed bytes between gzip access points */
+#define GZIP_SPAN (1024 * 1024)
+
+/* Bytes of history inflate needs to restart at an access point */
+#define GZIP_WINDOW 32768
+
+/* Decompressed frames kept by each open image */
+#define FRAME_CACHE_SLOTS 8
+
+/* Suffix of the prebuilt gzip index stored next to an image */
+#define GZIP_INDEX_SUFFIX ".idx"
+
+/* Opens a filesystem image for reading like fopen(filename, "rb"). gzip
+   images, and seekable zstd images in builds with ZSTD=1, are decompressed
+   on demand; the returned stream has no file descriptor */
+FILE *openImage(const char *filename);
+
+/* Scans a gzip image and writes its access point index to indexPath, so
+   later opens need no full decompression pass; returns a minError */
+int writeGzipIndex(const char *filename, const char *indexPath);
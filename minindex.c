@@ -0,0 +1,81 @@
+#include "minimage.h"
+#include "minutil.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Prints program usage information */
+void printUsage()
+{
+    fprintf(stderr,
+            "usage: minindex [ -o indexfile ] imagefile.gz\n"
+            "Writes the access point index that lets the other tools open a\n"
+            "gzip image without decompressing all of it first.\n"
+            "Options:\n"
+            "-o index   --- index file (default: imagefile.gz" GZIP_INDEX_SUFFIX
+            ")\n"
+            "-h help    --- print usage information and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    /* If no arguments specified, print usage */
+    if(argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+
+    char *indexPath = NULL;
+
+    /* Loop through argument flags */
+    int c;
+    while((c = getopt(argc, argv, "ho:")) != -1)
+    {
+        switch(c)
+        {
+        /* Index file is specified */
+        case 'o':
+            indexPath = optarg;
+            break;
+        /* Help flag */
+        case 'h':
+            printUsage();
+            return -1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        fprintf(stderr, "ERROR: image name required.\n");
+        printUsage();
+        return -1;
+    }
+    char *filename = argv[optind];
+
+    char *defaultPath = NULL;
+    if(indexPath == NULL)
+    {
+        defaultPath = malloc(strlen(filename) + sizeof(GZIP_INDEX_SUFFIX));
+        if(defaultPath == NULL)
+        {
+            fprintf(stderr, "ERROR: %s\n", minErrorString(MIN_ERR_NOMEM));
+            return -1;
+        }
+        sprintf(defaultPath, "%s%s", filename, GZIP_INDEX_SUFFIX);
+        indexPath = defaultPath;
+    }
+
+    int status = writeGzipIndex(filename, indexPath);
+    if(status == MIN_ERR_READ)
+        fprintf(stderr, "ERROR: %s is not a readable gzip image!\n", filename);
+    else if(status == MIN_ERR_WRITE)
+        fprintf(stderr, "ERROR: could not write index file!\n");
+    else if(status != MIN_OK)
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+
+    free(defaultPath);
+
+    return status == MIN_OK ? 0 : -1;
+}
@@ -1,6 +1,8 @@
+#include "minimage.h"
 #include "minutil.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -20,48 +22,194 @@ void *getPermissionString(int mode, char *modes)
     modes[10] = '\0';
 }
 
+/* Listing request shared by the threads of a scan of all filesystems */
+typedef struct listJob
+{
+    char *path;
+    fsLocation *found; /* first discovered filesystem */
+    char **text;       /* captured listing for each filesystem */
+    size_t *length;
+} listJob;
+
 /* Prints the permissions and other info for a file */
-void printFileInfo(inode *file, char *name)
+void printFileInfo(FILE *out, inode *file, char *name)
 {
     char modes[11];
     getPermissionString(file->mode, modes);
 
-    printf("%s %9d %s\n", modes, file->size, name);
+    fprintf(out, "%s %9d %s\n", modes, file->size, name);
 }
 
 /* Prints the contents of a directory */
-int printContents(inode *dir, char *path, FILE *image, superblock *sb,
-                  int partitionStart, int zonesize, int verbose)
+int printContents(FILE *out, inode *dir, char *path, FILE *image,
+                  superblock *sb, uint64_t partitionStart, int zonesize,
+                  int verbose)
 {
     if(isDirectory(dir))
     {
-        int containedFiles = dir->size / 64;
+        int direntsPerZone = zonesize / sizeof(dirent);
+        int containedFiles = dir->size / sizeof(dirent);
+        int totalZones = (containedFiles + direntsPerZone - 1) / direntsPerZone;
 
-        // char *zone1 = data + (dir->zone[0] * zonesize);
-        // dirent *contents = (dirent *)zone1;
+        fprintf(out, "%s:\n", path);
 
-        printf("%s:\n", path);
+        /* One zone buffer and one inode are reused for every entry */
+        minArena arena;
+        arenaInit(&arena, sb);
 
-        int i;
-        for(i = 0; i < containedFiles; i++)
+        int status = MIN_OK;
+
+        int z;
+        for(z = 0; z < totalZones && status == MIN_OK; z++)
         {
-            dirent current =
-                getDirEntByIndex(i, dir, image, sb, partitionStart, verbose);
+            arenaReset(&arena);
+
+            dirent *entries;
+            status = getZoneInArena(z, dir, image, sb, partitionStart, verbose,
+                                    &arena, (char **)&entries);
+            if(status != MIN_OK || entries == NULL)
+                continue;
 
-            if(current.inode != 0)
+            int count = containedFiles - (z * direntsPerZone);
+            if(count > direntsPerZone)
+                count = direntsPerZone;
+
+            arenaMark entryMark = arenaSave(&arena);
+
+            int i;
+            for(i = 0; i < count; i++)
             {
-                printFileInfo(
-                    getInode(current.inode, image, sb, partitionStart, verbose),
-                    current.name);
+                if(entries[i].inode == 0)
+                    continue;
+
+                arenaRelease(&arena, entryMark);
+
+                inode *file;
+                status = getInodeInArena(entries[i].inode, image, sb,
+                                         partitionStart, verbose, &arena,
+                                         &file);
+                if(status != MIN_OK)
+                    break;
+
+                /* Names fill all 60 bytes when they are at the maximum */
+                char name[sizeof(entries[i].name) + 1];
+                memcpy(name, entries[i].name, sizeof(entries[i].name));
+                name[sizeof(entries[i].name)] = '\0';
+
+                printFileInfo(out, file, name);
             }
         }
 
-        return 0;
+        arenaFree(&arena);
+
+        if(status != MIN_OK)
+            return status;
+
+        return MIN_OK;
     }
     else
     {
-        printFileInfo(dir, path);
+        printFileInfo(out, dir, path);
+        return MIN_OK;
+    }
+}
+
+/* Lists a path in one discovered filesystem into a private buffer */
+int listFilesystem(FILE *image, fsLocation *location, void *arg)
+{
+    listJob *job = (listJob *)arg;
+    int index = location - job->found;
+
+    FILE *out = open_memstream(&job->text[index], &job->length[index]);
+    if(out == NULL)
+        return MIN_ERR_NOMEM;
+
+    int zonesize = location->sb.blocksize << location->sb.log_zone_size;
+
+    inode *file;
+    int status =
+        findFile(job->path, image, &location->sb, location->start, 0, &file);
+    if(status == MIN_OK)
+    {
+        status = printContents(out, file, job->path, image, &location->sb,
+                               location->start, zonesize, 0);
+        free(file);
+    }
+
+    /* Errors go to stderr as they happen; stdout only carries listings */
+    if(status != MIN_OK)
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+
+    fclose(out);
+    return status;
+}
+
+/* Finds every filesystem in the image and lists the path in all of them */
+int listAllFilesystems(char *filename, FILE *image, char *path)
+{
+    fsLocation *found;
+    int count;
+    int status = findFilesystems(image, &found, &count);
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+
+    printf("%4s %4s %12s %12s %9s %9s %8s %8s\n", "part", "sub", "offset",
+           "size", "blocksize", "zonesize", "inodes", "zones");
+
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        superblock *sb = &found[i].sb;
+        char part[12] = "-", sub[12] = "-";
+        if(found[i].partition != -1)
+            sprintf(part, "%d", found[i].partition);
+        if(found[i].subpartition != -1)
+            sprintf(sub, "%d", found[i].subpartition);
+
+        printf("%4s %4s %12llu %12llu %9u %9u %8u %8u\n", part, sub,
+               (unsigned long long)found[i].start,
+               (unsigned long long)found[i].size, sb->blocksize,
+               sb->blocksize << sb->log_zone_size, sb->ninodes, sb->zones);
+    }
+
+    listJob job;
+    job.path = path;
+    job.found = found;
+    job.text = (char **)calloc(count ? count : 1, sizeof(char *));
+    job.length = (size_t *)calloc(count ? count : 1, sizeof(size_t));
+    if(job.text == NULL || job.length == NULL)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(MIN_ERR_NOMEM));
+        return -1;
+    }
+
+    int failures =
+        forEachFilesystem(filename, found, count, listFilesystem, &job);
+
+    /* Print the listings in discovery order */
+    for(i = 0; i < count; i++)
+    {
+        if(found[i].partition == -1)
+            printf("\nunpartitioned:\n");
+        else if(found[i].subpartition == -1)
+            printf("\npartition %d:\n", found[i].partition);
+        else
+            printf("\npartition %d, subpartition %d:\n", found[i].partition,
+                   found[i].subpartition);
+
+        if(job.text[i] != NULL)
+            fputs(job.text[i], stdout);
+        free(job.text[i]);
     }
+
+    free(job.text);
+    free(job.length);
+    free(found);
+
+    return failures ? -1 : 0;
 }
 
 /* Prints program usage information */
@@ -69,8 +217,9 @@ void printUsage()
 {
     fprintf(
         stderr,
-        "usage: minls [ -v ] [ -p num [ -s num ] ] imagefile [ path ]\n"
+        "usage: minls [ -v ] [ -a | -p num [ -s num ] ] imagefile [ path ]\n"
         "Options:\n"
+        "-a all     --- find every MINIX filesystem and list path in each\n"
         "-p part    --- select partition for filesystem (default: none)\n"
         "-s sub     --- select subpartition for filesystem (default: none)\n"
         "-h help    --- print usage information and exit\n"
@@ -92,10 +241,11 @@ int main(int argc, char **argv)
     int verbose = 0;
     int usePartition = -1;
     int useSubpart = -1;
+    int allFilesystems = 0;
 
     /* Loop through argument flags */
     int c;
-    while((c = getopt(argc, argv, "hvp:s:")) != -1)
+    while((c = getopt(argc, argv, "hvap:s:")) != -1)
     {
         switch(c)
         {
@@ -132,9 +282,19 @@ int main(int argc, char **argv)
         case 'v':
             verbose = 1;
             break;
+        /* Scan all filesystems */
+        case 'a':
+            allFilesystems = 1;
+            break;
         }
     }
 
+    if(allFilesystems && usePartition != -1)
+    {
+        fprintf(stderr, "ERROR: -a cannot be combined with -p or -s.\n");
+        return -1;
+    }
+
     /* Get image filename */
     if(optind < argc)
     {
@@ -153,38 +313,29 @@ int main(int argc, char **argv)
     }
 
     /* Open image file descriptor */
-    FILE *image = fopen(filename, "rb");
+    FILE *image = openImage(filename);
     if(image == NULL)
     {
         fprintf(stderr, "ERROR: file not found!\n");
         return -1;
     }
 
-    int partitionStart = 0;
-
-    /* If a partition was specified */
-    if(usePartition != -1)
+    /* List the path in every filesystem found in the image */
+    if(allFilesystems)
     {
-        /* Switch to specified partition */
-        partitionStart = enterPartition(image, partitionStart, usePartition);
-
-        /* If subpartition was specified */
-        if(useSubpart != -1)
-        {
-            /* Switch to subpartition */
-            partitionStart = enterPartition(image, partitionStart, useSubpart);
-        }
+        int result = listAllFilesystems(filename, image, path);
+        fclose(image);
+        return result;
     }
 
-    /* Get superblock */
-    superblock *sb =
-        (superblock *)getData(1024, sizeof(superblock), image, partitionStart);
-
-    /* Check magic number to ensure that this is a MINIX filesystem */
-    if(sb->magic != 0x4D5A)
+    /* Enter the selected partition and read its superblock */
+    uint64_t partitionStart;
+    superblock *sb;
+    int status =
+        openFilesystem(image, usePartition, useSubpart, &partitionStart, &sb);
+    if(status != MIN_OK)
     {
-        fprintf(stderr, "Bad magic number. (0x%04X)\n", sb->magic);
-        fprintf(stderr, "This doesn't look like a MINIX filesystem.\n");
+        printOpenError(status, sb);
         return -1;
     }
 
@@ -212,7 +363,17 @@ int main(int argc, char **argv)
     }
 
     /* Get inode of file at path specified */
-    inode *file = findFile(path, image, sb, partitionStart, verbose);
+    inode *file;
+    status = findFile(path, image, sb, partitionStart, verbose, &file);
+
+    /* Make sure file was found */
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        free(sb);
+        fclose(image);
+        return -1;
+    }
 
     /* If verbose mode is enabled, print file inode info */
     if(verbose)
@@ -252,16 +413,18 @@ int main(int argc, char **argv)
                file->two_indirect);
     }
 
-    /* Make sure file was found */
-    if(!file)
+    /* Print info about file, or directory contents */
+    status = printContents(stdout, file, path, image, sb, partitionStart,
+                           zonesize, verbose);
+    if(status != MIN_OK)
     {
-        fprintf(stderr, "ERROR: file not found!\n");
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        free(sb);
+        free(file);
+        fclose(image);
         return -1;
     }
 
-    /* Print info about file, or directory contents */
-    printContents(file, path, image, sb, partitionStart, zonesize, verbose);
-
     /* Free memory */
     free(sb);
     free(file);
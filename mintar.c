@@ -0,0 +1,599 @@
+#include "minimage.h"
+#include "minutil.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TAR_BLOCK 512
+
+#define MODE_TYPE 0170000
+#define MODE_FIFO 0010000
+#define MODE_CHAR 0020000
+#define MODE_BLOCK 0060000
+#define MODE_LINK 0120000
+
+/* POSIX ustar header, one 512 byte block */
+typedef struct tarHeader
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tarHeader;
+
+/* A regular file whose data is written after the tree walk */
+typedef struct pendingFile
+{
+    char *name;         /* archive member name */
+    uint32_t number;    /* inode number */
+    uint32_t firstZone; /* physical location used for ordering */
+    inode file;
+} pendingFile;
+
+/* State shared with the tree visitor while building the archive */
+typedef struct tarState
+{
+    FILE *image;
+    superblock *sb;
+    uint64_t partitionStart;
+    int verbose;
+    pendingFile *files;
+    int count;
+    int capacity;
+    int failures;
+} tarState;
+
+/* Bytes of file data written so far, for padding after a failed read */
+typedef struct dataState
+{
+    uint64_t written;
+} dataState;
+
+/* Writes a block of zeros for padding or the end of archive marker */
+int writeZeros(uint64_t length)
+{
+    static const char zeros[TAR_BLOCK];
+
+    while(length > 0)
+    {
+        size_t chunk = length < TAR_BLOCK ? length : TAR_BLOCK;
+        if(fwrite(zeros, 1, chunk, stdout) != chunk)
+            return MIN_ERR_WRITE;
+        length -= chunk;
+    }
+
+    return MIN_OK;
+}
+
+/* Writes a number as a zero padded octal field */
+void octalField(char *field, size_t width, uint64_t value)
+{
+    snprintf(field, width, "%0*llo", (int)width - 1,
+             (unsigned long long)value);
+}
+
+/* Copies text into a zero filled field; a field that is exactly full is not
+   NUL terminated, and anything longer is cut off */
+void textField(char *field, size_t width, const char *text, size_t length)
+{
+    memcpy(field, text, length < width ? length : width);
+}
+
+/* Builds a pax extended header record, "<len> key=value\n" */
+int paxRecord(char *out, size_t space, const char *key, const char *value)
+{
+    /* The length counts its own digits, so settle it by iterating */
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t length = body + 1;
+    while(snprintf(NULL, 0, "%zu", length) + body != length)
+        length = snprintf(NULL, 0, "%zu", length) + body;
+
+    if(length >= space)
+        return -1;
+
+    return snprintf(out, space, "%zu %s=%s\n", length, key, value);
+}
+
+/* Writes a header block, preceded by a pax header for long names */
+int writeHeader(const char *name, inode *file, char typeflag, uint64_t size,
+                const char *linkname)
+{
+    tarHeader header;
+    memset(&header, 0, sizeof(header));
+
+    size_t nameLength = strlen(name);
+    size_t linkLength = linkname ? strlen(linkname) : 0;
+    int splitAt = -1;
+
+    /* Names that do not fit use the ustar prefix, split at a slash */
+    if(nameLength > sizeof(header.name))
+    {
+        const char *slash = name + nameLength;
+        while(slash > name)
+        {
+            slash--;
+            if(*slash == '/' && slash - name <= sizeof(header.prefix) &&
+               nameLength - (slash - name) - 1 <= sizeof(header.name))
+            {
+                splitAt = slash - name;
+                break;
+            }
+        }
+    }
+
+    /* Anything still too long goes in a pax extended header */
+    if((nameLength > sizeof(header.name) && splitAt < 0) ||
+       linkLength > sizeof(header.linkname))
+    {
+        size_t space = nameLength + linkLength + 64;
+        char *records = malloc(space);
+        if(records == NULL)
+            return MIN_ERR_NOMEM;
+
+        int used = 0;
+        if(nameLength > sizeof(header.name) && splitAt < 0)
+            used += paxRecord(records, space, "path", name);
+        if(linkLength > sizeof(header.linkname))
+            used += paxRecord(records + used, space - used, "linkpath",
+                              linkname);
+
+        int status = writeHeader("././@PaxHeader", file, 'x', used, NULL);
+        if(status == MIN_OK && fwrite(records, 1, used, stdout) != used)
+            status = MIN_ERR_WRITE;
+        if(status == MIN_OK)
+            status = writeZeros((TAR_BLOCK - used % TAR_BLOCK) % TAR_BLOCK);
+
+        free(records);
+        if(status != MIN_OK)
+            return status;
+    }
+
+    if(splitAt >= 0)
+    {
+        memcpy(header.prefix, name, splitAt);
+        textField(header.name, sizeof(header.name), name + splitAt + 1,
+                  nameLength - splitAt - 1);
+    }
+    else
+    {
+        textField(header.name, sizeof(header.name), name, nameLength);
+    }
+    if(linkname != NULL)
+        textField(header.linkname, sizeof(header.linkname), linkname,
+                  linkLength);
+
+    octalField(header.mode, sizeof(header.mode), file->mode & 07777);
+    octalField(header.uid, sizeof(header.uid), file->uid);
+    octalField(header.gid, sizeof(header.gid), file->gid);
+    octalField(header.size, sizeof(header.size), size);
+    octalField(header.mtime, sizeof(header.mtime), (uint32_t)file->mtime);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    /* MINIX keeps the device number in the first zone */
+    if(typeflag == '3' || typeflag == '4')
+    {
+        octalField(header.devmajor, sizeof(header.devmajor),
+                   (file->zone[0] >> 8) & 0xFF);
+        octalField(header.devminor, sizeof(header.devminor),
+                   file->zone[0] & 0xFF);
+    }
+
+    /* The checksum is computed with its own field set to spaces */
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned int sum = 0;
+    size_t i;
+    for(i = 0; i < sizeof(header); i++)
+        sum += ((unsigned char *)&header)[i];
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", sum);
+
+    if(fwrite(&header, 1, sizeof(header), stdout) != sizeof(header))
+        return MIN_ERR_WRITE;
+
+    return MIN_OK;
+}
+
+/* Finds the first physical zone of a file, or 0 if it has no data */
+uint32_t firstZone(inode *file)
+{
+    int i;
+    for(i = 0; i < DIRECT_ZONES; i++)
+    {
+        if(file->zone[i] != 0)
+            return file->zone[i];
+    }
+
+    return file->indirect ? file->indirect : file->two_indirect;
+}
+
+/* Orders pending files by where their data starts on disk */
+int compareFiles(const void *a, const void *b)
+{
+    const pendingFile *left = (const pendingFile *)a;
+    const pendingFile *right = (const pendingFile *)b;
+
+    if(left->firstZone != right->firstZone)
+        return left->firstZone < right->firstZone ? -1 : 1;
+
+    return strcmp(left->name, right->name);
+}
+
+/* Orders pending files by inode so hard links can be found */
+int compareInodes(const void *a, const void *b)
+{
+    const pendingFile *left = *(const pendingFile **)a;
+    const pendingFile *right = *(const pendingFile **)b;
+
+    if(left->number != right->number)
+        return left->number < right->number ? -1 : 1;
+
+    /* Keep disk order among links to the same inode */
+    return left < right ? -1 : (left > right);
+}
+
+/* Emits directories and special files as they are found and queues
+   regular files for the ordered data pass */
+int archiveEntry(char *path, uint32_t number, inode *file, void *arg)
+{
+    tarState *state = (tarState *)arg;
+
+    /* Member names are relative to the image root */
+    while(*path == '/')
+        path++;
+
+    if(state->verbose == 1)
+        fprintf(stderr, "%s\n", path);
+
+    int status = MIN_OK;
+    uint16_t type = file->mode & MODE_TYPE;
+
+    if(isDirectory(file))
+    {
+        size_t length = strlen(path);
+        char *name = malloc(length + 2);
+        if(name == NULL)
+            return -MIN_ERR_NOMEM;
+        sprintf(name, "%s/", path);
+        status = writeHeader(name, file, '5', 0, NULL);
+        free(name);
+    }
+    else if(isRegularFile(file))
+    {
+        if(state->count == state->capacity)
+        {
+            state->capacity = state->capacity ? state->capacity * 2 : 256;
+            pendingFile *bigger = (pendingFile *)realloc(
+                state->files, state->capacity * sizeof(pendingFile));
+            if(bigger == NULL)
+                return -MIN_ERR_NOMEM;
+            state->files = bigger;
+        }
+
+        pendingFile *pending = &state->files[state->count];
+        pending->name = strdup(path);
+        if(pending->name == NULL)
+            return -MIN_ERR_NOMEM;
+        pending->number = number;
+        pending->firstZone = firstZone(file);
+        pending->file = *file;
+        state->count++;
+    }
+    else if(type == MODE_LINK)
+    {
+        /* The link target is the file's contents */
+        char *contents;
+        status = getFileContents(file, state->image, state->sb,
+                                 state->partitionStart, 0, &contents);
+        if(status == MIN_OK)
+        {
+            char *target = malloc(file->size + 1);
+            if(target == NULL)
+            {
+                free(contents);
+                return -MIN_ERR_NOMEM;
+            }
+            memcpy(target, contents, file->size);
+            target[file->size] = '\0';
+
+            status = writeHeader(path, file, '2', 0, target);
+
+            free(target);
+            free(contents);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: %s: %s\n", path, minErrorString(status));
+            state->failures++;
+            status = MIN_OK;
+        }
+    }
+    else if(type == MODE_CHAR || type == MODE_BLOCK || type == MODE_FIFO)
+    {
+        char flag = type == MODE_CHAR ? '3' : (type == MODE_BLOCK ? '4' : '6');
+        status = writeHeader(path, file, flag, 0, NULL);
+    }
+
+    /* Write failures end the walk; the visitor reports them negated */
+    return status == MIN_OK ? 0 : -status;
+}
+
+/* Copies one zone of file data into the archive */
+int writeZone(const unsigned char *data, uint32_t length, void *arg)
+{
+    dataState *state = (dataState *)arg;
+
+    if(fwrite(data, 1, length, stdout) != length)
+        return MIN_ERR_WRITE;
+
+    state->written += length;
+    return MIN_OK;
+}
+
+/* Writes the queued regular files in order of their location on disk */
+int writeFiles(tarState *state)
+{
+    /* Find hard links first: only the earliest on disk carries the data */
+    pendingFile **byInode =
+        (pendingFile **)malloc((state->count ? state->count : 1) *
+                               sizeof(pendingFile *));
+    char **linkTarget =
+        (char **)calloc(state->count ? state->count : 1, sizeof(char *));
+    if(byInode == NULL || linkTarget == NULL)
+    {
+        free(byInode);
+        free(linkTarget);
+        return MIN_ERR_NOMEM;
+    }
+
+    qsort(state->files, state->count, sizeof(pendingFile), compareFiles);
+
+    int i;
+    for(i = 0; i < state->count; i++)
+        byInode[i] = &state->files[i];
+    qsort(byInode, state->count, sizeof(pendingFile *), compareInodes);
+
+    for(i = 1; i < state->count; i++)
+    {
+        if(byInode[i]->number == byInode[i - 1]->number)
+        {
+            char *first = linkTarget[byInode[i - 1] - state->files];
+            linkTarget[byInode[i] - state->files] =
+                first ? first : byInode[i - 1]->name;
+        }
+    }
+    free(byInode);
+
+    int status = MIN_OK;
+
+    for(i = 0; i < state->count && status == MIN_OK; i++)
+    {
+        pendingFile *pending = &state->files[i];
+
+        if(linkTarget[i] != NULL)
+        {
+            status = writeHeader(pending->name, &pending->file, '1', 0,
+                                 linkTarget[i]);
+            continue;
+        }
+
+        uint32_t size = pending->file.size;
+        status = writeHeader(pending->name, &pending->file, '0', size, NULL);
+        if(status != MIN_OK)
+            break;
+
+        dataState data = {0};
+        int readStatus = streamFileContents(
+            &pending->file, state->image, state->sb, state->partitionStart,
+            0, writeZone, &data);
+
+        if(readStatus == MIN_ERR_WRITE)
+        {
+            status = readStatus;
+            break;
+        }
+
+        /* Keep the archive well formed even if the file could not be read */
+        if(readStatus != MIN_OK)
+        {
+            fprintf(stderr, "ERROR: %s: %s\n", pending->name,
+                    minErrorString(readStatus));
+            state->failures++;
+        }
+
+        status = writeZeros(size - data.written);
+        if(status == MIN_OK)
+            status = writeZeros((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    }
+
+    free(linkTarget);
+
+    return status;
+}
+
+/* Prints program usage information */
+void printUsage()
+{
+    fprintf(
+        stderr,
+        "usage: mintar [ -v ] [ -p num [ -s num ] ] imagefile [ path ]\n"
+        "Writes a tar archive of path (default: /) to stdout.\n"
+        "Options:\n"
+        "-p part    --- select partition for filesystem (default: none)\n"
+        "-s sub     --- select subpartition for filesystem (default: none)\n"
+        "-h help    --- print usage information and exit\n"
+        "-v verbose --- list archived paths on stderr\n");
+}
+
+int main(int argc, char **argv)
+{
+    /* If no arguments specified, print usage */
+    if(argc < 2)
+    {
+        printUsage();
+        return -1;
+    }
+
+    char *filename = NULL;
+    char *path = "/";
+
+    int verbose = 0;
+    int usePartition = -1;
+    int useSubpart = -1;
+
+    /* Loop through argument flags */
+    int c;
+    while((c = getopt(argc, argv, "hvp:s:")) != -1)
+    {
+        switch(c)
+        {
+        /* Partition is specified */
+        case 'p':
+            usePartition = atoi(optarg);
+            if(usePartition < 0 || usePartition > 3)
+            {
+                fprintf(stderr, "ERROR: partition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Subpartition is specified */
+        case 's':
+            if(usePartition == -1)
+            {
+                fprintf(stderr, "ERROR: cannot set subpartition unless main "
+                                "partition is specified.\n");
+                return -1;
+            }
+            useSubpart = atoi(optarg);
+            if(useSubpart < 0 || useSubpart > 3)
+            {
+                fprintf(stderr,
+                        "ERROR: subpartition must be in the range 0-3.\n");
+                return -1;
+            }
+            break;
+        /* Help flag */
+        case 'h':
+            printUsage();
+            return -1;
+        /* Verbose mode enabled */
+        case 'v':
+            verbose = 1;
+            break;
+        }
+    }
+
+    /* Get image filename */
+    if(optind < argc)
+    {
+        filename = argv[optind];
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: image name required.\n");
+        printUsage();
+        return -1;
+    }
+    /* Get path (if specified) */
+    if(optind + 1 < argc)
+    {
+        path = argv[optind + 1];
+    }
+
+    /* Refuse to write binary data to a terminal */
+    if(isatty(fileno(stdout)))
+    {
+        fprintf(stderr, "ERROR: refusing to write archive to a terminal.\n");
+        return -1;
+    }
+
+    /* Open image file */
+    FILE *image = openImage(filename);
+    if(image == NULL)
+    {
+        fprintf(stderr, "ERROR: file not found!\n");
+        return -1;
+    }
+
+    /* Enter the selected partition and read its superblock */
+    uint64_t partitionStart;
+    superblock *sb;
+    int status =
+        openFilesystem(image, usePartition, useSubpart, &partitionStart, &sb);
+    if(status != MIN_OK)
+    {
+        printOpenError(status, sb);
+        return -1;
+    }
+
+    inode *top;
+    status = findFile(path, image, sb, partitionStart, verbose, &top);
+    if(status != MIN_OK)
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+        return -1;
+    }
+
+    /* Large writes keep the pipe to a compressor or uploader full */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    tarState state;
+    state.image = image;
+    state.sb = sb;
+    state.partitionStart = partitionStart;
+    state.verbose = verbose;
+    state.files = NULL;
+    state.count = 0;
+    state.capacity = 0;
+    state.failures = 0;
+
+    /* The named entry itself comes first (the root has no entry) */
+    status = MIN_OK;
+    if(strcmp(path, "/") != 0 && strspn(path, "/") != strlen(path))
+        status = -archiveEntry(path, 0, top, &state);
+
+    /* Directories go out during the walk, file data in disk order after */
+    if(status == MIN_OK && isDirectory(top))
+    {
+        status = walkTree(path, top, image, sb, partitionStart, 0,
+                          archiveEntry, &state);
+        if(status < 0)
+            status = -status;
+    }
+    if(status == MIN_OK)
+        status = writeFiles(&state);
+
+    /* End of archive marker */
+    if(status == MIN_OK)
+        status = writeZeros(2 * TAR_BLOCK);
+    if(status == MIN_OK && fflush(stdout) != 0)
+        status = MIN_ERR_WRITE;
+
+    if(status != MIN_OK)
+        fprintf(stderr, "ERROR: %s\n", minErrorString(status));
+
+    int i;
+    for(i = 0; i < state.count; i++)
+        free(state.files[i].name);
+    free(state.files);
+    free(top);
+    free(sb);
+    fclose(image);
+
+    return (status != MIN_OK || state.failures) ? -1 : 0;
+}
@@ -1,44 +1,228 @@
+#include "minimage.h"
 #include "minutil.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+/* Gets the message describing a status code */
+const char *minErrorString(int error)
+{
+    switch(error)
+    {
+    case MIN_OK:
+        return "success";
+    case MIN_ERR_SEEK:
+        return "tried to access invalid image location!";
+    case MIN_ERR_READ:
+        return "could not read all data from image!";
+    case MIN_ERR_NOMEM:
+        return "could not allocate memory!";
+    case MIN_ERR_FILE_SIZE:
+        return "trying to get zone exceeding maximum file size!";
+    case MIN_ERR_PART_TABLE:
+        return "invalid partition table!";
+    case MIN_ERR_PART_TYPE:
+        return "not a MINIX partition!";
+    case MIN_ERR_MAGIC:
+        return "This doesn't look like a MINIX filesystem.";
+    case MIN_ERR_NOT_FOUND:
+    case MIN_ERR_NOT_DIR:
+        return "file not found!";
+    case MIN_ERR_WRITE:
+        return "could not write all data!";
+    case MIN_ERR_NO_FS:
+        return "no MINIX filesystem found!";
+    case MIN_ERR_CORRUPT:
+        return "filesystem is corrupt!";
+    default:
+        return "unknown error!";
+    }
+}
+
+/* Reads bytes from the filesystem image into a caller's buffer */
+int readData(uint64_t start, uint32_t size, FILE *file,
+             uint64_t partitionStart, unsigned char *buffer)
+{
+    /* Offsets past what off_t can hold cannot be in the image */
+    uint64_t offset = start + partitionStart;
+    if(offset < start || offset > (uint64_t)INT64_MAX - size)
+        return MIN_ERR_SEEK;
+
+    /* Compressed images have no descriptor; read them through the stream */
+    int fd = fileno(file);
+    if(fd < 0)
+    {
+        if(fseeko(file, (off_t)offset, SEEK_SET) != 0)
+            return MIN_ERR_SEEK;
+        if(fread(buffer, 1, size, file) != size)
+            return MIN_ERR_READ;
+
+        return MIN_OK;
+    }
+
+    /* Read data from image with positional reads, which leave the stream's
+       file position alone and so never need a seek */
+    uint32_t done = 0;
+    while(done < size)
+    {
+        ssize_t got = pread(fd, buffer + done, size - done,
+                            (off_t)(offset + done));
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            return (got < 0 && errno == EINVAL) ? MIN_ERR_SEEK : MIN_ERR_READ;
+        done += got;
+    }
+
+    return MIN_OK;
+}
 
 /* Reads bytes from the filesystem image at a specified location */
-unsigned char *getData(uint32_t start, uint32_t size, FILE *file,
-                       int partitionStart)
+int getData(uint64_t start, uint32_t size, FILE *file,
+            uint64_t partitionStart, unsigned char **data)
 {
+    *data = NULL;
+
     /* Allocate buffer for read data */
-    unsigned char *data = (unsigned char *)malloc(size);
+    unsigned char *buffer = (unsigned char *)malloc(size);
+    if(buffer == NULL)
+        return MIN_ERR_NOMEM;
 
-    /* Seek to specified start location */
-    int status = fseek(file, start + partitionStart, SEEK_SET);
-    if(status != 0)
+    int status = readData(start, size, file, partitionStart, buffer);
+    if(status != MIN_OK)
     {
-        fprintf(stderr, "ERROR: tried to access invalid image location!\n");
-        exit(-1);
+        free(buffer);
+        return status;
     }
 
-    /* Read data from image */
-    int read = fread(data, 1, size, file);
-    if(read != size)
+    *data = buffer;
+    return MIN_OK;
+}
+
+/* Sets up an empty arena for a filesystem's zone size */
+void arenaInit(minArena *arena, superblock *sb)
+{
+    memset(arena, 0, sizeof(minArena));
+    arena->zonesize = (uint32_t)sb->blocksize << sb->log_zone_size;
+}
+
+/* Hands out a zone sized buffer, or NULL if out of memory */
+char *arenaZone(minArena *arena)
+{
+    /* Reuse a buffer given back earlier if there is one */
+    if(arena->zonesUsed < arena->zoneCount)
+        return arena->zones[arena->zonesUsed++];
+
+    if(arena->zoneCount == arena->zoneCapacity)
     {
-        fprintf(stderr, "ERROR: could not read all data from image!\n");
-        exit(-1);
+        int capacity = arena->zoneCapacity ? arena->zoneCapacity * 2 : 8;
+        char **bigger =
+            (char **)realloc(arena->zones, capacity * sizeof(char *));
+        if(bigger == NULL)
+            return NULL;
+        arena->zones = bigger;
+        arena->zoneCapacity = capacity;
     }
 
-    return data;
+    char *zone = (char *)malloc(arena->zonesize);
+    if(zone == NULL)
+        return NULL;
+
+    arena->zones[arena->zoneCount++] = zone;
+    arena->zonesUsed++;
+    return zone;
 }
 
-/* Gets a data zone from an inode at a given index (starting from zero) */
-char *getZoneByIndex(int index, inode *file, FILE *image, superblock *sb,
-                     int partitionStart, int verbose)
+/* Hands out an inode, or NULL if out of memory */
+inode *arenaInode(minArena *arena)
 {
-    if(verbose == 1)
-        printf("getZoneByIndex: %d\n", index);
+    int block = arena->inodesUsed / ARENA_INODES;
+
+    if(block == arena->inodeBlockCount)
+    {
+        inode **bigger = (inode **)realloc(arena->inodeBlocks,
+                                           (block + 1) * sizeof(inode *));
+        if(bigger == NULL)
+            return NULL;
+        arena->inodeBlocks = bigger;
+
+        bigger[block] = (inode *)malloc(ARENA_INODES * sizeof(inode));
+        if(bigger[block] == NULL)
+            return NULL;
+        arena->inodeBlockCount++;
+    }
+
+    return &arena->inodeBlocks[block][arena->inodesUsed++ % ARENA_INODES];
+}
+
+/* Records what an arena has handed out so far */
+arenaMark arenaSave(minArena *arena)
+{
+    arenaMark mark;
+    mark.zones = arena->zonesUsed;
+    mark.inodes = arena->inodesUsed;
+    return mark;
+}
 
-    int blocksize = sb->blocksize;
-    int zonesize = blocksize << sb->log_zone_size;
+/* Takes back everything handed out since a mark */
+void arenaRelease(minArena *arena, arenaMark mark)
+{
+    arena->zonesUsed = mark.zones;
+    arena->inodesUsed = mark.inodes;
+}
+
+/* Takes back everything handed out */
+void arenaReset(minArena *arena)
+{
+    arena->zonesUsed = 0;
+    arena->inodesUsed = 0;
+}
+
+/* Frees all of an arena's memory */
+void arenaFree(minArena *arena)
+{
+    int i;
+    for(i = 0; i < arena->zoneCount; i++)
+        free(arena->zones[i]);
+    for(i = 0; i < arena->inodeBlockCount; i++)
+        free(arena->inodeBlocks[i]);
+    free(arena->zones);
+    free(arena->inodeBlocks);
+    memset(arena, 0, sizeof(minArena));
+}
+
+/* Reads one indirect zone's entry, using an arena buffer for the zone */
+static int readZoneLink(uint32_t indirect, int entry, FILE *image,
+                        uint64_t partitionStart, minArena *arena,
+                        uint32_t *link)
+{
+    arenaMark mark = arenaSave(arena);
+
+    uint32_t *links = (uint32_t *)arenaZone(arena);
+    if(links == NULL)
+        return MIN_ERR_NOMEM;
+
+    int status = readData((uint64_t)indirect * arena->zonesize,
+                          arena->zonesize, image, partitionStart,
+                          (unsigned char *)links);
+    if(status == MIN_OK)
+        *link = links[entry];
+
+    arenaRelease(arena, mark);
+
+    return status;
+}
+
+/* Finds the zone number holding a logical zone of a file; 0 is a hole */
+static int getZoneNumber(int index, inode *file, FILE *image, superblock *sb,
+                         uint64_t partitionStart, int verbose,
+                         minArena *arena, uint32_t *zone)
+{
+    *zone = 0;
 
     /* Target is a direct zone */
     if(index < DIRECT_ZONES)
@@ -46,116 +230,223 @@ char *getZoneByIndex(int index, inode *file, FILE *image, superblock *sb,
         if(verbose == 1)
             printf("\tzone: %d\n", file->zone[index]);
 
-        /* Check if the zone is a hole */
-        if(file->zone[index] == 0)
-            return NULL;
+        *zone = file->zone[index];
+        return MIN_OK;
+    }
 
-        char *data = getData(file->zone[index] * zonesize, zonesize, image,
-                             partitionStart);
+    int indirectIndex = index - DIRECT_ZONES;
+    int numIndirectLinks = sb->blocksize / sizeof(uint32_t);
 
-        if(verbose == 1)
-            printf("\tzone data: %s\n", data);
+    if(verbose == 1)
+        printf("indirectIndex: %d\n", indirectIndex);
 
-        return data;
-    }
-    /* Target is an indirect zone */
-    else
+    /* Target is in a single indirect zone, unless that is a hole */
+    if(indirectIndex < numIndirectLinks)
     {
-        int indirectIndex = index - DIRECT_ZONES;
-        int numIndirectLinks = blocksize / sizeof(uint32_t);
+        if(file->indirect == 0)
+            return MIN_OK;
 
-        if(verbose == 1)
-            printf("indirectIndex: %d\n", indirectIndex);
+        return readZoneLink(file->indirect, indirectIndex, image,
+                            partitionStart, arena, zone);
+    }
 
-        /* Target is in a single indirect zone */
-        if(indirectIndex < numIndirectLinks)
-        {
-            /* Check if the indirect zone is a hole */
-            if(file->indirect == 0)
-                return NULL;
+    /* Target is in a doubly indirect zone */
+    int doubleIndirectIndex = indirectIndex - numIndirectLinks;
+    if(doubleIndirectIndex >= numIndirectLinks * numIndirectLinks)
+        return MIN_ERR_FILE_SIZE;
+
+    /* Check if doubly indirect zone is a hole */
+    if(file->two_indirect == 0)
+        return MIN_OK;
+
+    /* Get the indirect zone from the doubly indirect zone */
+    uint32_t indirectZoneNumber;
+    int status = readZoneLink(file->two_indirect,
+                              doubleIndirectIndex / numIndirectLinks, image,
+                              partitionStart, arena, &indirectZoneNumber);
+    if(status != MIN_OK || indirectZoneNumber == 0)
+        return status;
+
+    /* Find the target zone in the indirect zone */
+    return readZoneLink(indirectZoneNumber,
+                        doubleIndirectIndex % numIndirectLinks, image,
+                        partitionStart, arena, zone);
+}
 
-            /* Get reference to indirect zone */
-            uint32_t *indirectZone = (uint32_t *)(getData(
-                file->indirect * zonesize, zonesize, image, partitionStart));
+/* Starts mapping the zones of a file */
+void openZoneCursor(zoneCursor *cursor, inode *file, FILE *image,
+                    superblock *sb, uint64_t partitionStart)
+{
+    cursor->file = file;
+    cursor->image = image;
+    cursor->sb = sb;
+    cursor->partitionStart = partitionStart;
+    cursor->indirect = NULL;
+    cursor->twoIndirect = NULL;
+    cursor->second = NULL;
+    cursor->secondIndex = -1;
+}
 
-            /* Check if the zone is a hole */
-            if(indirectZone[indirectIndex] == 0)
-            {
-                free(indirectZone);
-                return NULL;
-            }
+/* Frees the indirect blocks a cursor has cached */
+void closeZoneCursor(zoneCursor *cursor)
+{
+    free(cursor->indirect);
+    free(cursor->twoIndirect);
+    free(cursor->second);
+}
 
-            /* Find and return the target zone */
-            char *data = getData(indirectZone[indirectIndex] * zonesize,
-                                 zonesize, image, partitionStart);
+/* Reads an indirect block for a cursor; it must lie in the data area */
+static int readCursorLinks(zoneCursor *cursor, uint32_t zone,
+                           uint32_t **links)
+{
+    superblock *sb = cursor->sb;
+    if(zone < sb->firstdata || zone >= sb->zones)
+        return MIN_ERR_CORRUPT;
 
-            free(indirectZone);
+    uint64_t zonesize = (uint64_t)sb->blocksize << sb->log_zone_size;
+    return getData(zone * zonesize, sb->blocksize, cursor->image,
+                   cursor->partitionStart, (unsigned char **)links);
+}
 
-            return data;
-        }
-        /* Target is in a doubly indirect zone */
-        else
+/* Finds the zone number holding a logical zone of a file; 0 is a hole */
+int getCursorZone(zoneCursor *cursor, int index, uint32_t *zone)
+{
+    inode *file = cursor->file;
+    int links = cursor->sb->blocksize / sizeof(uint32_t);
+    int status;
+
+    *zone = 0;
+
+    if(index < DIRECT_ZONES)
+    {
+        *zone = file->zone[index];
+        return MIN_OK;
+    }
+
+    index -= DIRECT_ZONES;
+    if(index < links)
+    {
+        if(file->indirect == 0)
+            return MIN_OK;
+        if(cursor->indirect == NULL)
         {
-            int doubleIndirectIndex = indirectIndex - numIndirectLinks;
+            status = readCursorLinks(cursor, file->indirect,
+                                     &cursor->indirect);
+            if(status != MIN_OK)
+                return status;
+        }
+        *zone = cursor->indirect[index];
+        return MIN_OK;
+    }
 
-            if(doubleIndirectIndex < numIndirectLinks * numIndirectLinks)
-            {
-                /* Check if doubly indirect zone is a hole */
-                if(file->two_indirect == 0)
-                    return NULL;
+    index -= links;
+    if(index / links >= links)
+        return MIN_ERR_FILE_SIZE;
+    if(file->two_indirect == 0)
+        return MIN_OK;
+    if(cursor->twoIndirect == NULL)
+    {
+        status = readCursorLinks(cursor, file->two_indirect,
+                                 &cursor->twoIndirect);
+        if(status != MIN_OK)
+            return status;
+    }
 
-                /* Get reference to doubly indirect zone */
-                uint32_t *doubleIndirectZone =
-                    (uint32_t *)(getData(file->two_indirect * zonesize,
-                                         zonesize, image, partitionStart));
+    /* Keep the last indirect block below the doubly indirect one */
+    int secondIndex = index / links;
+    if(cursor->secondIndex != secondIndex)
+    {
+        free(cursor->second);
+        cursor->second = NULL;
+        cursor->secondIndex = -1;
+
+        uint32_t secondZone = cursor->twoIndirect[secondIndex];
+        if(secondZone == 0)
+            return MIN_OK;
+        status = readCursorLinks(cursor, secondZone, &cursor->second);
+        if(status != MIN_OK)
+            return status;
+        cursor->secondIndex = secondIndex;
+    }
+    *zone = cursor->second[index % links];
 
-                /* Get index of indirect zone in doubly indirect zone */
-                int indirectZoneIndex = doubleIndirectIndex / numIndirectLinks;
+    return MIN_OK;
+}
 
-                /* Check if indirect zone is a hole */
-                if(doubleIndirectZone[indirectZoneIndex] == 0)
-                {
-                    free(doubleIndirectZone);
-                    return NULL;
-                }
+/* Gets a data zone from an inode at a given index (starting from zero);
+   holes come back as NULL */
+int getZoneByIndex(int index, inode *file, FILE *image, superblock *sb,
+                   uint64_t partitionStart, int verbose, char **zone)
+{
+    *zone = NULL;
 
-                /* Get reference to indirect zone */
-                uint32_t *indirectZone = (uint32_t *)(getData(
-                    doubleIndirectZone[indirectZoneIndex] * zonesize, zonesize,
-                    image, partitionStart));
+    if(verbose == 1)
+        printf("getZoneByIndex: %d\n", index);
 
-                free(doubleIndirectZone);
+    /* A short lived arena holds any indirect zones */
+    minArena arena;
+    arenaInit(&arena, sb);
 
-                /* Get index of target in indirect zone */
-                int directZoneIndex = doubleIndirectIndex % numIndirectLinks;
+    uint32_t zonesize = arena.zonesize;
+    uint32_t number;
+    int status = getZoneNumber(index, file, image, sb, partitionStart,
+                               verbose, &arena, &number);
+    arenaFree(&arena);
 
-                /* Check if the zone is a hole */
-                if(indirectZone[directZoneIndex] == 0)
-                {
-                    free(indirectZone);
-                    return NULL;
-                }
+    /* Check if the zone is a hole */
+    if(status != MIN_OK || number == 0)
+        return status;
 
-                /* Find and return the target zone */
-                char *data = getData(indirectZone[directZoneIndex] * zonesize,
-                                     zonesize, image, partitionStart);
+    status = getData((uint64_t)number * zonesize, zonesize, image,
+                     partitionStart, (unsigned char **)zone);
 
-                free(indirectZone);
+    if(verbose == 1 && status == MIN_OK)
+        printf("\tzone data: %s\n", *zone);
 
-                return data;
-            }
-        }
+    return status;
+}
 
-        fprintf(stderr,
-                "ERROR: trying to get zone exceeding maximum file size!\n");
-        exit(-1);
+/* Like getZoneByIndex(), but the zone is a buffer from the arena */
+int getZoneInArena(int index, inode *file, FILE *image, superblock *sb,
+                   uint64_t partitionStart, int verbose, minArena *arena,
+                   char **zone)
+{
+    *zone = NULL;
+
+    if(verbose == 1)
+        printf("getZoneByIndex: %d\n", index);
+
+    uint32_t number;
+    int status = getZoneNumber(index, file, image, sb, partitionStart,
+                               verbose, arena, &number);
+
+    /* Check if the zone is a hole */
+    if(status != MIN_OK || number == 0)
+        return status;
+
+    arenaMark mark = arenaSave(arena);
+    char *buffer = arenaZone(arena);
+    if(buffer == NULL)
+        return MIN_ERR_NOMEM;
+
+    status = readData((uint64_t)number * arena->zonesize, arena->zonesize,
+                      image, partitionStart, (unsigned char *)buffer);
+    if(status != MIN_OK)
+    {
+        arenaRelease(arena, mark);
+        return status;
     }
+
+    *zone = buffer;
+    return MIN_OK;
 }
 
 /* Retrieves the contents of a file */
-char *getFileContents(inode *file, FILE *image, superblock *sb,
-                      int partitionStart, int verbose)
+int getFileContents(inode *file, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, char **contents)
 {
+    *contents = NULL;
+
     /* Initialize buffer for file data with all zeros */
     char *fileData = (char *)calloc(file->size, sizeof(char));
 
@@ -163,15 +454,17 @@ char *getFileContents(inode *file, FILE *image, superblock *sb,
         printf("fileData size: %d\n", file->size);
 
     if(fileData == NULL)
-    {
-        fprintf(stderr, "ERROR: could not allocate memory for file data!\n");
-        exit(-1);
-    }
+        return MIN_ERR_NOMEM;
 
-    int zonesize = sb->blocksize << sb->log_zone_size;
+    /* One arena buffer is reused for every zone */
+    minArena arena;
+    arenaInit(&arena, sb);
+    int zonesize = arena.zonesize;
 
-    /* Calculate the number of zones the file contains */
-    int totalZones = (file->size / zonesize) + ((file->size % zonesize) != 0);
+    /* Calculate the number of zones the file contains, and how much of the
+       last one is used */
+    uint32_t tail = file->size % zonesize;
+    int totalZones = file->size / zonesize + (tail != 0);
 
     if(verbose == 1)
         printf("totalZones: %d\n", totalZones);
@@ -180,9 +473,18 @@ char *getFileContents(inode *file, FILE *image, superblock *sb,
     int i;
     for(i = 0; i < totalZones; i++)
     {
+        arenaReset(&arena);
+
         /* Retrieve the target zone */
-        char *zoneData =
-            getZoneByIndex(i, file, image, sb, partitionStart, verbose);
+        char *zoneData;
+        int status = getZoneInArena(i, file, image, sb, partitionStart,
+                                    verbose, &arena, &zoneData);
+        if(status != MIN_OK)
+        {
+            arenaFree(&arena);
+            free(fileData);
+            return status;
+        }
 
         /* If it's not a hole, copy it to the buffer */
         if(zoneData != NULL)
@@ -190,18 +492,16 @@ char *getFileContents(inode *file, FILE *image, superblock *sb,
             int bytesToCopy = zonesize;
 
             /* If this is the last zone, only copy the relevant portion */
-            if(i == totalZones - 1 && file->size % zonesize != 0)
-                bytesToCopy = file->size % zonesize;
+            if(i == totalZones - 1 && tail != 0)
+                bytesToCopy = tail;
 
             if(verbose == 1)
                 printf("bytesToCopy: %d\n", bytesToCopy);
 
-            memcpy(fileData + (i * zonesize), zoneData, bytesToCopy);
+            memcpy(fileData + ((size_t)i * zonesize), zoneData, bytesToCopy);
 
             if(verbose == 1)
                 printf("fileData: %s\n", fileData);
-
-            free(zoneData);
         }
         else
         {
@@ -210,20 +510,121 @@ char *getFileContents(inode *file, FILE *image, superblock *sb,
         }
     }
 
+    arenaFree(&arena);
+
     if(verbose == 1)
         printf("fileData: %s\n", fileData);
 
-    return fileData;
+    *contents = fileData;
+    return MIN_OK;
+}
+
+/* Passes a file's contents to a handler one zone at a time */
+int streamFileContents(inode *file, FILE *image, superblock *sb,
+                       uint64_t partitionStart, int verbose,
+                       zoneHandler handler, void *arg)
+{
+    /* Zones are read into one reused arena buffer; holes are handed out as
+       a block of zeros kept below it */
+    minArena arena;
+    arenaInit(&arena, sb);
+    int zonesize = arena.zonesize;
+
+    /* Calculate the number of zones the file contains, and how much of the
+       last one is used */
+    uint32_t tail = file->size % zonesize;
+    int totalZones = file->size / zonesize + (tail != 0);
+    arenaMark zoneMark = arenaSave(&arena);
+    unsigned char *holeData = NULL;
+
+    int status = MIN_OK;
+
+    /* Loop through all relevant zones */
+    int i;
+    for(i = 0; i < totalZones && status == MIN_OK; i++)
+    {
+        uint32_t bytesToSend = zonesize;
+
+        /* If this is the last zone, only send the relevant portion */
+        if(i == totalZones - 1 && tail != 0)
+            bytesToSend = tail;
+
+        /* Retrieve the target zone */
+        arenaRelease(&arena, zoneMark);
+        char *zoneData;
+        status = getZoneInArena(i, file, image, sb, partitionStart, verbose,
+                                &arena, &zoneData);
+        if(status != MIN_OK)
+            break;
+
+        if(zoneData != NULL)
+        {
+            status = handler((unsigned char *)zoneData, bytesToSend, arg);
+        }
+        else
+        {
+            if(verbose == 1)
+                printf("zone is a hole!\n");
+
+            if(holeData == NULL)
+            {
+                holeData = (unsigned char *)arenaZone(&arena);
+                if(holeData == NULL)
+                {
+                    status = MIN_ERR_NOMEM;
+                    break;
+                }
+                memset(holeData, 0, zonesize);
+                zoneMark = arenaSave(&arena);
+            }
+
+            status = handler(holeData, bytesToSend, arg);
+        }
+    }
+
+    arenaFree(&arena);
+
+    return status;
 }
 
 /* Gets an inode struct given its index */
-inode *getInode(int number, FILE *image, superblock *sb, int partitionStart,
-                int verbose)
+int getInode(int number, FILE *image, superblock *sb, uint64_t partitionStart,
+             int verbose, inode **file)
+{
+    uint64_t start =
+        ((2 + (uint64_t)sb->i_blocks + sb->z_blocks) * sb->blocksize) +
+        ((uint64_t)(number - 1) * sizeof(inode));
+
+    return getData(start, sizeof(inode), image, partitionStart,
+                   (unsigned char **)file);
+}
+
+/* Like getInode(), but the inode comes from the arena */
+int getInodeInArena(int number, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, minArena *arena,
+                    inode **file)
 {
-    int start = ((2 + sb->i_blocks + sb->z_blocks) * sb->blocksize) +
-                ((number - 1) * sizeof(inode));
+    uint64_t start =
+        ((2 + (uint64_t)sb->i_blocks + sb->z_blocks) * sb->blocksize) +
+        ((uint64_t)(number - 1) * sizeof(inode));
+
+    *file = NULL;
+
+    arenaMark mark = arenaSave(arena);
+    inode *buffer = arenaInode(arena);
+    if(buffer == NULL)
+        return MIN_ERR_NOMEM;
+
+    int status = readData(start, sizeof(inode), image, partitionStart,
+                          (unsigned char *)buffer);
+    if(status != MIN_OK)
+    {
+        arenaRelease(arena, mark);
+        return status;
+    }
 
-    return (inode *)getData(start, sizeof(inode), image, partitionStart);
+    *file = buffer;
+    return MIN_OK;
 }
 
 /* Checks if a file is a directory */
@@ -239,96 +640,351 @@ int isRegularFile(inode *file)
 }
 
 /* Gets the directory entry at a certain index */
-dirent getDirEntByIndex(int index, inode *dir, FILE *image, superblock *sb,
-                        int partitionStart, int verbose)
+int getDirEntByIndex(int index, inode *dir, FILE *image, superblock *sb,
+                     uint64_t partitionStart, int verbose, dirent *entry)
 {
-    int zonesize = sb->blocksize << sb->log_zone_size;
-    int direntsPerZone = zonesize / sizeof(dirent);
+    minArena arena;
+    arenaInit(&arena, sb);
+    uint32_t direntsPerZone = arena.zonesize / sizeof(dirent);
 
     /* Get zone containing target dirent */
     int targetZoneIndex = index / direntsPerZone;
-    char *targetZone = getZoneByIndex(targetZoneIndex, dir, image, sb,
-                                      partitionStart, verbose);
+    dirent *targetZone;
+    int status = getZoneInArena(targetZoneIndex, dir, image, sb,
+                                partitionStart, verbose, &arena,
+                                (char **)&targetZone);
+
+    /* A hole holds no entries */
+    if(status == MIN_OK && targetZone == NULL)
+        memset(entry, 0, sizeof(dirent));
+    else if(status == MIN_OK)
+        *entry = targetZone[index % direntsPerZone];
+
+    arenaFree(&arena);
+
+    return status;
+}
+
+/* A name laid out like a directory entry's name field, so that most entries
+   are turned away on their first word without a byte by byte compare */
+typedef struct nameKey
+{
+    unsigned char name[60];
+    size_t length;     /* bytes that must match, counting the terminator */
+    uint64_t head;     /* first word of the name, masked */
+    uint64_t headMask; /* bytes of the first word that must match */
+} nameKey;
+
+/* Builds the key for a name that fits in a directory entry */
+static void makeNameKey(char *name, nameKey *key)
+{
+    size_t length = strlen(name);
 
-    /* Get index of target dirent in the zone */
-    int relativeIndex = index - (targetZoneIndex * direntsPerZone);
+    memset(key, 0, sizeof(nameKey));
+    memcpy(key->name, name, length);
 
-    /* Get target dirent */
-    dirent target = *(dirent *)(targetZone + (relativeIndex * sizeof(dirent)));
+    /* Shorter names end in a NUL in the entry, which has to match too */
+    key->length = length < sizeof(key->name) ? length + 1 : length;
 
-    free(targetZone);
+    /* Built bytewise so the mask is right for either byte order */
+    unsigned char mask[sizeof(uint64_t)] = {0};
+    memset(mask, 0xff,
+           key->length < sizeof(mask) ? key->length : sizeof(mask));
+    memcpy(&key->headMask, mask, sizeof(mask));
+    memcpy(&key->head, key->name, sizeof(key->head));
+    key->head &= key->headMask;
+}
 
-    return target;
+/* Checks a directory entry's name against a key; the same test as a
+   strncmp() over the 60 byte field */
+static int matchesKey(dirent *entry, nameKey *key)
+{
+    uint64_t head;
+    memcpy(&head, entry->name, sizeof(head));
+    if(((head ^ key->head) & key->headMask) != 0)
+        return 0;
+
+    return key->length <= sizeof(head) ||
+           memcmp(entry->name + sizeof(head), key->name + sizeof(head),
+                  key->length - sizeof(head)) == 0;
 }
 
 /* Gets the directory entry with a certain name */
-dirent getDirEntByName(char *name, inode *dir, FILE *image, superblock *sb,
-                       int partitionStart, int verbose)
+int getDirEntByName(char *name, inode *dir, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, dirent *entry)
 {
-    int containedFiles = dir->size / 64;
+    /* Names fill all 60 bytes when they are at the maximum length */
+    if(strlen(name) > sizeof(entry->name))
+        return MIN_ERR_NOT_FOUND;
 
-    int i;
-    for(i = 0; i < containedFiles; i++)
+    nameKey key;
+    makeNameKey(name, &key);
+
+    /* Scan the directory a whole zone at a time in one reused buffer */
+    minArena arena;
+    arenaInit(&arena, sb);
+
+    int direntsPerZone = arena.zonesize / sizeof(dirent);
+    int containedFiles = dir->size / sizeof(dirent);
+    int totalZones = (containedFiles + direntsPerZone - 1) / direntsPerZone;
+
+    int status = MIN_ERR_NOT_FOUND;
+
+    int z;
+    for(z = 0; z < totalZones && status == MIN_ERR_NOT_FOUND; z++)
     {
-        dirent current =
-            getDirEntByIndex(i, dir, image, sb, partitionStart, verbose);
+        arenaReset(&arena);
 
-        if(current.inode != 0 && strcmp(name, current.name) == 0)
-            return current;
+        dirent *entries;
+        int readStatus = getZoneInArena(z, dir, image, sb, partitionStart,
+                                        verbose, &arena, (char **)&entries);
+        if(readStatus != MIN_OK)
+        {
+            status = readStatus;
+            break;
+        }
+        if(entries == NULL)
+            continue;
+
+        int count = containedFiles - (z * direntsPerZone);
+        if(count > direntsPerZone)
+            count = direntsPerZone;
+
+        int i;
+        for(i = 0; i < count; i++)
+        {
+            if(entries[i].inode != 0 && matchesKey(&entries[i], &key))
+            {
+                *entry = entries[i];
+                status = MIN_OK;
+                break;
+            }
+        }
     }
 
-    dirent null = {-1, ""};
-    return null;
+    arenaFree(&arena);
+
+    return status;
+}
+
+/* Recursive worker for walkTree that tracks the current depth; zones and
+   inodes come from the walk's arena and go back to it level by level, and
+   visited marks each directory entered so a loop is caught the first time
+   it comes around */
+static int walkTreeDepth(char *path, inode *dir, FILE *image, superblock *sb,
+                         uint64_t partitionStart, int verbose,
+                         treeVisitor visitor, void *arg, minArena *arena,
+                         uint8_t *visited, int depth)
+{
+    /* Guard against directory loops in corrupt images */
+    if(depth > MAX_TREE_DEPTH)
+    {
+        fprintf(stderr, "WARNING: %s is nested too deeply, skipping\n", path);
+        return MIN_OK;
+    }
+
+    int direntsPerZone = arena->zonesize / sizeof(dirent);
+    int containedFiles = dir->size / sizeof(dirent);
+    int totalZones = (containedFiles + direntsPerZone - 1) / direntsPerZone;
+
+    size_t pathLength = strlen(path);
+    char *childPath = malloc(pathLength + sizeof(((dirent *)0)->name) + 2);
+    if(childPath == NULL)
+        return MIN_ERR_NOMEM;
+
+    strcpy(childPath, path);
+    if(pathLength == 0 || path[pathLength - 1] != '/')
+        childPath[pathLength++] = '/';
+
+    arenaMark levelMark = arenaSave(arena);
+    int status = MIN_OK;
+
+    /* Scan the directory a whole zone at a time */
+    int z;
+    for(z = 0; z < totalZones && status == MIN_OK; z++)
+    {
+        arenaRelease(arena, levelMark);
+
+        dirent *entries;
+        status = getZoneInArena(z, dir, image, sb, partitionStart, verbose,
+                                arena, (char **)&entries);
+        if(status != MIN_OK || entries == NULL)
+            continue;
+
+        int count = containedFiles - (z * direntsPerZone);
+        if(count > direntsPerZone)
+            count = direntsPerZone;
+
+        arenaMark entryMark = arenaSave(arena);
+
+        int i;
+        for(i = 0; i < count && status == MIN_OK; i++)
+        {
+            dirent *current = &entries[i];
+            if(current->inode == 0 || strcmp((char *)current->name, ".") == 0 ||
+               strcmp((char *)current->name, "..") == 0)
+                continue;
+
+            /* Names fill all 60 bytes when they are at the maximum length */
+            size_t nameLength =
+                strnlen((char *)current->name, sizeof(current->name));
+            memcpy(childPath + pathLength, current->name, nameLength);
+            childPath[pathLength + nameLength] = '\0';
+
+            arenaRelease(arena, entryMark);
+
+            inode *child;
+            status = getInodeInArena(current->inode, image, sb,
+                                     partitionStart, verbose, arena, &child);
+            if(status != MIN_OK)
+                break;
+
+            status = visitor(childPath, current->inode, child, arg);
+            if(status == 0 && isDirectory(child))
+            {
+                /* A directory reached twice means the tree loops */
+                uint32_t number = current->inode;
+                if(number > sb->ninodes ||
+                   (visited[number / 8] & (1 << (number % 8))))
+                {
+                    status = MIN_ERR_CORRUPT;
+                    break;
+                }
+                visited[number / 8] |= 1 << (number % 8);
+
+                status = walkTreeDepth(childPath, child, image, sb,
+                                       partitionStart, verbose, visitor, arg,
+                                       arena, visited, depth + 1);
+            }
+            else if(status > 0)
+                status = MIN_OK;
+        }
+    }
+
+    arenaRelease(arena, levelMark);
+    free(childPath);
+
+    return status;
+}
+
+/* Visits every entry below a directory (excluding . and ..), depth first;
+   returns a minError, or the visitor's value if it stopped the walk */
+int walkTree(char *path, inode *dir, FILE *image, superblock *sb,
+             uint64_t partitionStart, int verbose, treeVisitor visitor,
+             void *arg)
+{
+    /* One arena and one set of visited directories serve the whole walk */
+    uint8_t *visited = (uint8_t *)calloc(sb->ninodes / 8 + 1, 1);
+    if(visited == NULL)
+        return MIN_ERR_NOMEM;
+
+    minArena arena;
+    arenaInit(&arena, sb);
+
+    int status = walkTreeDepth(path, dir, image, sb, partitionStart, verbose,
+                               visitor, arg, &arena, visited, 0);
+
+    arenaFree(&arena);
+    free(visited);
+
+    return status;
 }
 
 /* Finds a file inode given the path */
-inode *findFile(char *path, FILE *image, superblock *sb, int partitionStart,
-                int verbose)
+int findFile(char *path, FILE *image, superblock *sb, uint64_t partitionStart,
+             int verbose, inode **file)
 {
-    inode *current = getInode(1, image, sb, partitionStart, verbose);
+    uint32_t number;
+    return findFileNumber(path, image, sb, partitionStart, verbose, &number,
+                          file);
+}
+
+/* Like findFile(), but also gives the inode's number */
+int findFileNumber(char *path, FILE *image, superblock *sb,
+                   uint64_t partitionStart, int verbose, uint32_t *number,
+                   inode **file)
+{
+    *file = NULL;
+    *number = 1;
+
+    /* The inodes along the path only live as long as the lookup */
+    minArena arena;
+    arenaInit(&arena, sb);
 
-    char *tempPath = malloc(strlen(path) + 1);
-    strcpy(tempPath, path);
+    inode *current;
+    int status = getInodeInArena(1, image, sb, partitionStart, verbose,
+                                 &arena, &current);
+
+    char *tempPath = NULL;
+    if(status == MIN_OK)
+    {
+        tempPath = malloc(strlen(path) + 1);
+        if(tempPath == NULL)
+            status = MIN_ERR_NOMEM;
+    }
+
+    char *token = NULL;
+    if(status == MIN_OK)
+    {
+        strcpy(tempPath, path);
+        token = strtok(tempPath, "/");
+    }
 
-    char *token = strtok(tempPath, "/");
     while(token != NULL)
     {
         if(!isDirectory(current))
         {
-            fprintf(stderr, "ERROR: file not found!\n");
-            exit(-1);
+            status = MIN_ERR_NOT_DIR;
+            break;
         }
 
-        dirent newDir =
-            getDirEntByName(token, current, image, sb, partitionStart, verbose);
+        dirent newDir;
+        status = getDirEntByName(token, current, image, sb, partitionStart,
+                                 verbose, &newDir);
+        if(status != MIN_OK)
+            break;
 
-        if(newDir.inode == -1)
-        {
-            free(tempPath);
-            free(current);
-            return NULL;
-        }
-        free(current);
-        current = getInode(newDir.inode, image, sb, partitionStart, verbose);
+        status = getInodeInArena(newDir.inode, image, sb, partitionStart,
+                                 verbose, &arena, &current);
+        if(status != MIN_OK)
+            break;
+        *number = newDir.inode;
 
         token = strtok(NULL, "/");
     }
 
     free(tempPath);
-    return current;
+
+    /* The caller gets its own copy of the final inode */
+    if(status == MIN_OK)
+    {
+        *file = (inode *)malloc(sizeof(inode));
+        if(*file == NULL)
+            status = MIN_ERR_NOMEM;
+        else
+            **file = *current;
+    }
+
+    arenaFree(&arena);
+
+    return status;
 }
 
 /* Gets the location on disk of a specified partition */
-uint32_t enterPartition(FILE *file, uint32_t currentStart, int partIndex)
+int enterPartition(FILE *file, uint64_t currentStart, int partIndex,
+                   uint64_t *start)
 {
     /* Get the the partition table */
-    unsigned char *data = getData(0, 512, file, currentStart);
+    unsigned char *data;
+    int status = getData(0, 512, file, currentStart, &data);
+    if(status != MIN_OK)
+        return status;
 
     /* Check partition table signature for validity */
     if(*((data + 510)) != 0x55 || *(data + 511) != 0xAA)
     {
-        fprintf(stderr, "ERROR: invalid partition table!\n");
-        exit(-1);
+        free(data);
+        return MIN_ERR_PART_TABLE;
     }
 
     /* Get the target partition table entry */
@@ -338,14 +994,269 @@ uint32_t enterPartition(FILE *file, uint32_t currentStart, int partIndex)
     /* Make sure it is a valid MINIX partition */
     if(part->type != 0x81)
     {
-        fprintf(stderr, "ERROR: not a MINIX partition!\n");
-        exit(-1);
+        free(data);
+        return MIN_ERR_PART_TYPE;
     }
 
     /* Get the offset to the partition contents */
-    int start = part->lFirst * 512;
+    *start = (uint64_t)part->lFirst * 512;
 
     free(data);
 
-    return start;
+    return MIN_OK;
+}
+
+/* Enters the selected partition (-1 for none) and subpartition, then reads
+   and checks the superblock; on MIN_ERR_MAGIC the superblock is still
+   returned so the caller can report it */
+int openFilesystem(FILE *image, int usePartition, int useSubpart,
+                   uint64_t *partitionStart, superblock **sb)
+{
+    *partitionStart = 0;
+    *sb = NULL;
+
+    uint64_t start = 0;
+    int status;
+
+    /* If a partition was specified */
+    if(usePartition != -1)
+    {
+        /* Switch to specified partition */
+        status = enterPartition(image, start, usePartition, &start);
+        if(status != MIN_OK)
+            return status;
+
+        /* If subpartition was specified */
+        if(useSubpart != -1)
+        {
+            /* Switch to subpartition */
+            status = enterPartition(image, start, useSubpart, &start);
+            if(status != MIN_OK)
+                return status;
+        }
+    }
+
+    *partitionStart = start;
+
+    /* Get superblock */
+    status = getData(1024, sizeof(superblock), image, *partitionStart,
+                     (unsigned char **)sb);
+    if(status != MIN_OK)
+        return status;
+
+    /* Check magic number to ensure that this is a MINIX filesystem */
+    if((*sb)->magic != 0x4D5A)
+        return MIN_ERR_MAGIC;
+
+    return MIN_OK;
+}
+
+/* Prints the command line message for a failed openFilesystem() and frees
+   the superblock if one was returned */
+void printOpenError(int error, superblock *sb)
+{
+    if(error == MIN_ERR_MAGIC)
+    {
+        fprintf(stderr, "Bad magic number. (0x%04X)\n", sb->magic);
+        fprintf(stderr, "This doesn't look like a MINIX filesystem.\n");
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: %s\n", minErrorString(error));
+    }
+
+    free(sb);
+}
+
+/* Adds the filesystem at start to the list if its superblock checks out */
+static int probeFilesystem(FILE *image, uint64_t start, uint64_t size,
+                           int part, int sub, fsLocation **found, int *count,
+                           int *capacity)
+{
+    superblock *sb;
+
+    /* Anything unreadable or with the wrong magic is simply not a hit */
+    if(getData(1024, sizeof(superblock), image, start,
+               (unsigned char **)&sb) != MIN_OK)
+        return MIN_OK;
+
+    if(sb->magic != 0x4D5A)
+    {
+        free(sb);
+        return MIN_OK;
+    }
+
+    if(*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        fsLocation *bigger =
+            (fsLocation *)realloc(*found, *capacity * sizeof(fsLocation));
+        if(bigger == NULL)
+        {
+            free(sb);
+            return MIN_ERR_NOMEM;
+        }
+        *found = bigger;
+    }
+
+    fsLocation *location = &(*found)[(*count)++];
+    location->partition = part;
+    location->subpartition = sub;
+    location->start = start;
+    location->size = size;
+    location->sb = *sb;
+
+    free(sb);
+    return MIN_OK;
+}
+
+/* Reads the partition table at start, or returns NULL if there is none */
+static partition *readPartitionTable(FILE *image, uint64_t start)
+{
+    unsigned char *data;
+    if(getData(0, 512, image, start, &data) != MIN_OK)
+        return NULL;
+
+    /* Check partition table signature for validity */
+    if(*((data + 510)) != 0x55 || *(data + 511) != 0xAA)
+    {
+        free(data);
+        return NULL;
+    }
+
+    /* Move the four entries to the front of the buffer */
+    memmove(data, data + 0x1BE, 4 * sizeof(partition));
+
+    return (partition *)data;
+}
+
+/* Finds every MINIX filesystem in an image: the unpartitioned image, each
+   primary partition and each subpartition; the list is malloc'd, and
+   finding none is MIN_ERR_NO_FS */
+int findFilesystems(FILE *image, fsLocation **found, int *count)
+{
+    int capacity = 0;
+    *found = NULL;
+    *count = 0;
+
+    /* A filesystem written straight onto the image */
+    int status = probeFilesystem(image, 0, 0, -1, -1, found, count, &capacity);
+
+    partition *table = readPartitionTable(image, 0);
+
+    int p;
+    for(p = 0; table != NULL && p < 4 && status == MIN_OK; p++)
+    {
+        if(table[p].type != 0x81 || table[p].size == 0)
+            continue;
+
+        uint64_t start = (uint64_t)table[p].lFirst * 512;
+        status = probeFilesystem(image, start, (uint64_t)table[p].size * 512,
+                                 p, -1, found, count, &capacity);
+
+        /* Subpartition tables sit at the start of their primary partition */
+        partition *subtable = readPartitionTable(image, start);
+
+        int s;
+        for(s = 0; subtable != NULL && s < 4 && status == MIN_OK; s++)
+        {
+            if(subtable[s].type != 0x81 || subtable[s].size == 0)
+                continue;
+
+            status = probeFilesystem(image, (uint64_t)subtable[s].lFirst * 512,
+                                     (uint64_t)subtable[s].size * 512, p, s,
+                                     found, count, &capacity);
+        }
+
+        free(subtable);
+    }
+
+    free(table);
+
+    if(status == MIN_OK && *count == 0)
+        status = MIN_ERR_NO_FS;
+
+    if(status != MIN_OK)
+    {
+        free(*found);
+        *found = NULL;
+        *count = 0;
+    }
+
+    return status;
+}
+
+/* Work handed to one filesystem's thread */
+typedef struct filesystemJob
+{
+    char *filename;
+    fsLocation *location;
+    filesystemWorker worker;
+    void *arg;
+    int result;
+    int started; /* the job has its own thread to join */
+} filesystemJob;
+
+/* Thread body: opens a private stream and runs the worker */
+static void *runFilesystemJob(void *arg)
+{
+    filesystemJob *job = (filesystemJob *)arg;
+
+    FILE *image = openImage(job->filename);
+    if(image == NULL)
+    {
+        job->result = -1;
+        return NULL;
+    }
+
+    job->result = job->worker(image, job->location, job->arg);
+
+    fclose(image);
+    return NULL;
+}
+
+/* Runs a worker on every listed filesystem concurrently, one thread each;
+   returns the number of workers that failed */
+int forEachFilesystem(char *filename, fsLocation *found, int count,
+                      filesystemWorker worker, void *arg)
+{
+    filesystemJob *jobs =
+        (filesystemJob *)calloc(count ? count : 1, sizeof(filesystemJob));
+    pthread_t *threads = (pthread_t *)calloc(count ? count : 1,
+                                             sizeof(pthread_t));
+    if(jobs == NULL || threads == NULL)
+    {
+        free(jobs);
+        free(threads);
+        return count;
+    }
+
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        jobs[i].filename = filename;
+        jobs[i].location = &found[i];
+        jobs[i].worker = worker;
+        jobs[i].arg = arg;
+
+        /* Fall back to running inline if no thread is available */
+        jobs[i].started =
+            pthread_create(&threads[i], NULL, runFilesystemJob, &jobs[i]) == 0;
+        if(!jobs[i].started)
+            runFilesystemJob(&jobs[i]);
+    }
+
+    int failures = 0;
+    for(i = 0; i < count; i++)
+    {
+        if(jobs[i].started)
+            pthread_join(threads[i], NULL);
+        if(jobs[i].result != 0)
+            failures++;
+    }
+
+    free(jobs);
+    free(threads);
+
+    return failures;
 }
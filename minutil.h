@@ -3,6 +3,9 @@
 
 #define DIRECT_ZONES 7
 
+/* Deepest directory nesting followed when walking a tree */
+#define MAX_TREE_DEPTH 256
+
 typedef struct partition
 {
     uint8_t bootint;
@@ -58,21 +61,153 @@ typedef struct dirent
     unsigned char name[60];
 } dirent;
 
+/* A MINIX filesystem found while scanning an image's partition tables */
+typedef struct fsLocation
+{
+    int partition;    /* primary partition index, or -1 if unpartitioned */
+    int subpartition; /* subpartition index, or -1 if none */
+    uint64_t start;   /* byte offset of the filesystem in the image */
+    uint64_t size;    /* size in bytes from the partition table (0 if none) */
+    superblock sb;    /* copy of the filesystem's superblock */
+} fsLocation;
+
+/* Inodes in each block of an arena */
+#define ARENA_INODES 64
+
+/* Zone buffers and inodes for one operation (a lookup, a walk, an
+   extraction), sized from the filesystem geometry; they are handed back all
+   at once and reused, instead of being malloc'd and freed per read */
+typedef struct minArena
+{
+    uint32_t zonesize;   /* size of every zone buffer */
+    char **zones;        /* zone buffers owned by the arena */
+    int zoneCount;
+    int zoneCapacity;
+    int zonesUsed;       /* zones[0 .. zonesUsed) are handed out */
+    inode **inodeBlocks; /* blocks of ARENA_INODES inodes */
+    int inodeBlockCount;
+    int inodesUsed;
+} minArena;
+
+/* What an arena had handed out at some point, to roll back to */
+typedef struct arenaMark
+{
+    int zones;
+    int inodes;
+} arenaMark;
+
+/* Status codes returned by the image reading functions */
+typedef enum minError
+{
+    MIN_OK = 0,
+    MIN_ERR_SEEK,       /* seek outside of the image */
+    MIN_ERR_READ,       /* short read from the image */
+    MIN_ERR_NOMEM,      /* allocation failure */
+    MIN_ERR_FILE_SIZE,  /* zone index past the largest possible file */
+    MIN_ERR_PART_TABLE, /* partition table signature missing */
+    MIN_ERR_PART_TYPE,  /* partition is not of type MINIX */
+    MIN_ERR_MAGIC,      /* superblock magic number is wrong */
+    MIN_ERR_NOT_FOUND,  /* no directory entry with that name */
+    MIN_ERR_NOT_DIR,    /* path component is not a directory */
+    MIN_ERR_WRITE,      /* output could not be written */
+    MIN_ERR_NO_FS,      /* no MINIX filesystem anywhere in the image */
+    MIN_ERR_CORRUPT     /* a loop, or a bad inode or indirect zone */
+} minError;
+
+/* Gets the message describing a status code */
+const char *minErrorString(int error);
+
 /* Reads bytes from the filesystem image at a specified location */
-unsigned char *getData(uint32_t start, uint32_t size, FILE *file,
-                       int partitionStart);
+int getData(uint64_t start, uint32_t size, FILE *file,
+            uint64_t partitionStart, unsigned char **data);
+
+/* Reads bytes from the filesystem image into a caller's buffer */
+int readData(uint64_t start, uint32_t size, FILE *file,
+             uint64_t partitionStart, unsigned char *buffer);
+
+/* Sets up an empty arena for a filesystem's zone size */
+void arenaInit(minArena *arena, superblock *sb);
+
+/* Hands out a zone sized buffer, or NULL if out of memory */
+char *arenaZone(minArena *arena);
+
+/* Hands out an inode, or NULL if out of memory */
+inode *arenaInode(minArena *arena);
+
+/* Records what an arena has handed out so far */
+arenaMark arenaSave(minArena *arena);
+
+/* Takes back everything handed out since a mark */
+void arenaRelease(minArena *arena, arenaMark mark);
+
+/* Takes back everything handed out */
+void arenaReset(minArena *arena);
 
-/* Gets a data zone from an inode at a given index (starting from zero) */
-char *getZoneByIndex(int index, inode *file, FILE *image, superblock *sb,
-                     int partitionStart, int verbose);
+/* Frees all of an arena's memory */
+void arenaFree(minArena *arena);
+
+/* Gets a data zone from an inode at a given index (starting from zero);
+   holes come back as NULL */
+int getZoneByIndex(int index, inode *file, FILE *image, superblock *sb,
+                   uint64_t partitionStart, int verbose, char **zone);
+
+/* Like getZoneByIndex(), but the zone is a buffer from the arena */
+int getZoneInArena(int index, inode *file, FILE *image, superblock *sb,
+                   uint64_t partitionStart, int verbose, minArena *arena,
+                   char **zone);
+
+/* Maps a file's logical zones to zone numbers, caching the indirect blocks
+   it reads so walking a file zone by zone reads each of them once */
+typedef struct zoneCursor
+{
+    inode *file;
+    FILE *image;
+    superblock *sb;
+    uint64_t partitionStart;
+    uint32_t *indirect;
+    uint32_t *twoIndirect;
+    uint32_t *second; /* the indirect block below twoIndirect last used */
+    int secondIndex;  /* which one it is, or -1 */
+} zoneCursor;
+
+/* Starts mapping the zones of a file */
+void openZoneCursor(zoneCursor *cursor, inode *file, FILE *image,
+                    superblock *sb, uint64_t partitionStart);
+
+/* Finds the zone number holding a logical zone of a file; 0 is a hole and
+   an indirect block outside the data area is MIN_ERR_CORRUPT */
+int getCursorZone(zoneCursor *cursor, int index, uint32_t *zone);
+
+/* Frees the indirect blocks a cursor has cached */
+void closeZoneCursor(zoneCursor *cursor);
+
+/* Called with each consecutive chunk of a file's contents; a nonzero return
+   (normally a minError) stops the stream and is passed back to the caller */
+typedef int (*zoneHandler)(const unsigned char *data, uint32_t length,
+                           void *arg);
+
+/* Called for each entry found while walking a directory tree; returning a
+   positive value skips the entry's subtree, a negative value stops the walk */
+typedef int (*treeVisitor)(char *path, uint32_t number, inode *file,
+                           void *arg);
 
 /* Retrieves the contents of a file */
-char *getFileContents(inode *file, FILE *image, superblock *sb,
-                      int partitionStart, int verbose);
+int getFileContents(inode *file, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, char **contents);
+
+/* Passes a file's contents to a handler one zone at a time */
+int streamFileContents(inode *file, FILE *image, superblock *sb,
+                       uint64_t partitionStart, int verbose,
+                       zoneHandler handler, void *arg);
 
 /* Gets an inode struct given its index */
-inode *getInode(int number, FILE *image, superblock *sb, int partitionStart,
-                int verbose);
+int getInode(int number, FILE *image, superblock *sb, uint64_t partitionStart,
+             int verbose, inode **file);
+
+/* Like getInode(), but the inode comes from the arena */
+int getInodeInArena(int number, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, minArena *arena,
+                    inode **file);
 
 /* Checks if a file is a directory */
 int isDirectory(inode *file);
@@ -81,16 +216,52 @@ int isDirectory(inode *file);
 int isRegularFile(inode *file);
 
 /* Gets the directory entry at a certain index */
-dirent getDirEntByIndex(int index, inode *dir, FILE *image, superblock *sb,
-                        int partitionStart, int verbose);
+int getDirEntByIndex(int index, inode *dir, FILE *image, superblock *sb,
+                     uint64_t partitionStart, int verbose, dirent *entry);
 
 /* Gets the directory entry with a certain name */
-dirent getDirEntByName(char *name, inode *dir, FILE *image, superblock *sb,
-                       int partitionStart, int verbose);
+int getDirEntByName(char *name, inode *dir, FILE *image, superblock *sb,
+                    uint64_t partitionStart, int verbose, dirent *entry);
+
+/* Visits every entry below a directory (excluding . and ..), depth first;
+   returns a minError, or the visitor's value if it stopped the walk */
+int walkTree(char *path, inode *dir, FILE *image, superblock *sb,
+             uint64_t partitionStart, int verbose, treeVisitor visitor,
+             void *arg);
 
 /* Finds a file inode given the path */
-inode *findFile(char *path, FILE *image, superblock *sb, int partitionStart,
-                int verbose);
+int findFile(char *path, FILE *image, superblock *sb, uint64_t partitionStart,
+             int verbose, inode **file);
+
+/* Like findFile(), but also gives the inode's number */
+int findFileNumber(char *path, FILE *image, superblock *sb,
+                   uint64_t partitionStart, int verbose, uint32_t *number,
+                   inode **file);
+
+/* Enters the selected partition (-1 for none) and subpartition, then reads
+   and checks the superblock; on MIN_ERR_MAGIC the superblock is still
+   returned so the caller can report it */
+int openFilesystem(FILE *image, int usePartition, int useSubpart,
+                   uint64_t *partitionStart, superblock **sb);
+
+/* Prints the command line message for a failed openFilesystem() and frees
+   the superblock if one was returned */
+void printOpenError(int error, superblock *sb);
+
+/* Finds every MINIX filesystem in an image: the unpartitioned image, each
+   primary partition and each subpartition; the list is malloc'd, and
+   finding none is MIN_ERR_NO_FS */
+int findFilesystems(FILE *image, fsLocation **found, int *count);
+
+/* Called once per filesystem by forEachFilesystem(), with a private stream
+   on the image; a nonzero return counts as a failure */
+typedef int (*filesystemWorker)(FILE *image, fsLocation *location, void *arg);
+
+/* Runs a worker on every listed filesystem concurrently, one thread each;
+   returns the number of workers that failed */
+int forEachFilesystem(char *filename, fsLocation *found, int count,
+                      filesystemWorker worker, void *arg);
 
 /* Gets the location on disk of a specified partition */
-uint32_t enterPartition(FILE *file, uint32_t currentStart, int partIndex);
+int enterPartition(FILE *file, uint64_t currentStart, int partIndex,
+                   uint64_t *start);